@@ -0,0 +1,73 @@
+/* PS5 FTP Server - Delta synchronization wire format
+ * Used by SITE DSIG / SITE DAPPLY (rsync-style block diff)
+ *
+ * 1. PASV, then "SITE DSIG <file>": the server sends over the data
+ *    connection a delta_sig_header_t followed by block_count
+ *    delta_sig_block_t entries (one per block_size block, last may be short).
+ * 2. The client scans its new version with the rolling weak checksum,
+ *    confirms candidate matches with the strong hash, and builds a delta.
+ * 3. PASV, then "SITE DAPPLY <file>": the client sends a delta_apply_header_t
+ *    (echoing the signature's block_size, file_size and mtime) followed by
+ *    delta_op_t operations:
+ *      DELTA_OP_COPY     arg1 = first block, arg2 = block count
+ *      DELTA_OP_LITERAL  arg1 = byte count (<= DELTA_MAX_LITERAL), data follows
+ *      DELTA_OP_END      followed by the SHA-256 of the complete new file
+ *    The server builds the new file next to the old one, verifies the
+ *    SHA-256 and renames it into place.
+ *
+ * All fields are little-endian (native on PS5 and x86 hosts).
+ */
+
+#ifndef PS5_FTP_DELTA_H
+#define PS5_FTP_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_SIG_MAGIC 0x47495344u     // "DSIG"
+#define DELTA_APPLY_MAGIC 0x41544c44u   // "DLTA"
+#define DELTA_STRONG_LEN 16             // Truncated SHA-256 per block
+#define DELTA_MAX_LITERAL (4 * 1024 * 1024)
+
+#define DELTA_OP_END 0
+#define DELTA_OP_COPY 1
+#define DELTA_OP_LITERAL 2
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t file_size;
+    int64_t mtime;
+    uint32_t block_count;
+} delta_sig_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG_LEN];
+} delta_sig_block_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t basis_size;
+    int64_t basis_mtime;
+} delta_apply_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t op;
+    uint32_t arg1;
+    uint32_t arg2;
+} delta_op_t;
+
+// rsync weak checksum: s1 = sum of bytes, s2 = sum of running s1, both mod 2^16.
+// Rolling one byte forward: s1 += in - out; s2 += s1 - len * out.
+static inline uint32_t delta_weak_checksum(const uint8_t *data, size_t len) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -19,56 +20,1651 @@
 #include <time.h>
 #include <ifaddrs.h>
 #include <sys/uio.h>
+#include <stdint.h>
+#include <poll.h>
+#ifdef __FreeBSD__
+#include <sys/event.h>
+#endif
+
+#include "trace.h"
+#include "delta.h"
 
 #define FTP_PORT 2121
 #define DATA_PORT_START 2122
+#define DATA_PORT_COUNT 100         // Passive data ports DATA_PORT_START .. START + COUNT - 1
+#define DATA_PORT_WAIT_MS 2000      // PASV/EPSV wait this long for a free port before 425
 #define BUFFER_SIZE (4 * 1024 * 1024)
 #define MAX_PATH 1024
 
-typedef struct notify_request {
-    char useless1[45];
-    char message[3075];
-} notify_request_t;
+// Control-session trace recording (toggle at runtime with SITE TRACE ON/OFF)
+#define TRACE_DIR "/data/ftp_traces"
+#define TRACE_ENABLED_DEFAULT 0
+#define TRACE_FILE_BUFFER (64 * 1024)
+
+// Content hash index for upload deduplication (SITE DEDUP)
+#define HASH_INDEX_PATH "/data/ftp_hash_index.bin"
+#define HASH_INDEX_BUCKETS 4096
+#define HASH_SCAN_ROOTS "/data", "/mnt/usb0", "/mnt/usb1", "/mnt/ext0", "/mnt/ext1"
+#define HASH_SCAN_MIN_SIZE (1024 * 1024)    // Smaller files are cheap to upload again
+#define HASH_SCAN_MAX_FILES 65536           // Files remembered by the lazy scan
+#define HASH_SCAN_INTERVAL 600              // Seconds before a miss walks the roots again
+
+// Download read-ahead and next-file prefetch
+#define READAHEAD_WINDOW_MS 500             // Read-ahead covers this much link time
+#define READAHEAD_MIN (1 * 1024 * 1024)
+#define READAHEAD_MAX (32 * 1024 * 1024)
+#define PREFETCH_WARM_MAX (32 * 1024 * 1024) // Bytes of the next file pulled into cache
+#define PREFETCH_QUEUE_LEN 8
+#define PREFETCH_RECENT 16
+#define PREFETCH_LIST_MAX 4096              // Files remembered from the last LIST
+
+// In-memory cache for small, frequently downloaded files and directory listings
+#define HOT_CACHE_SIZE (32 * 1024 * 1024)   // 0 disables the cache
+#define HOT_CACHE_FILE_MAX (256 * 1024)     // Largest file or listing kept
+#define HOT_CACHE_SLOTS 512
+#define HOT_CACHE_LIST_TTL 5                // Seconds; a directory's mtime misses size changes
+
+// Change journal for incremental sync (SITE CHANGES / SITE WATCH)
+#define CHANGE_JOURNAL_SIZE 4096            // Changes kept before old tokens expire
+#define CHANGE_WATCH_MAX 64                 // Directories watched with kqueue
+
+// Delta sync (SITE DSIG / SITE DAPPLY) block size bounds
+#define DELTA_MIN_BLOCK 4096
+#define DELTA_MAX_BLOCK (1024 * 1024)
+#define DELTA_APPLY_MAX 16                  // Concurrent SITE DAPPLY operations
+
+typedef struct notify_request {
+    char useless1[45];
+    char message[3075];
+} notify_request_t;
+
+int sceKernelSendNotificationRequest(int, notify_request_t*, size_t, int);
+
+void send_notification(const char *msg) {
+    notify_request_t req;
+    memset(&req, 0, sizeof(req));
+    strncpy(req.message, msg, sizeof(req.message) - 1);
+    sceKernelSendNotificationRequest(0, &req, sizeof(req), 0);
+}
+
+typedef struct {
+    int control_sock;
+    int data_sock;              // Listening socket of the pooled data port
+    int data_port;
+    int data_slot;
+    char current_dir[MAX_PATH];
+    char rename_from[MAX_PATH];
+    int passive_mode;
+    off_t restart_offset;
+    struct sockaddr_in data_addr;
+    FILE *trace;
+    uint64_t trace_start_us;
+    uint64_t transfer_bytes;
+    char **listing;             // Regular files of the last LIST, in order
+    int listing_count;
+    char listing_dir[MAX_PATH];
+    int last_retr_index;
+} ftp_session_t;
+
+typedef struct {
+    volatile uint64_t downloads;
+    volatile uint64_t download_bytes;
+    volatile uint64_t readahead_hints;
+    volatile uint64_t link_rate;        // Bytes/sec, moving average over downloads
+    volatile uint64_t prefetch_issued;
+    volatile uint64_t prefetch_hits;
+    volatile uint64_t prefetch_bytes;
+    volatile uint64_t cache_hits;
+    volatile uint64_t cache_misses;
+    volatile uint64_t cache_bytes_served;
+} server_stats_t;
+
+static server_stats_t stats;
+
+typedef struct {
+    int client_sock;
+    struct sockaddr_in client_addr;
+} client_info_t;
+
+static volatile int trace_enabled = TRACE_ENABLED_DEFAULT;
+
+// Reply code of the last response sent by this session's thread (for tracing)
+static __thread int last_reply_code;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// SHA-256 (FIPS 180-4), used for delta block and whole-file verification
+typedef struct {
+    uint32_t state[8];
+    uint64_t bitlen;
+    uint8_t data[64];
+    uint32_t datalen;
+} sha256_ctx_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(sha256_ctx_t *ctx, const uint8_t *data) {
+    uint32_t m[64];
+    for (int i = 0; i < 16; i++) {
+        m[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+               ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(m[i - 15], 7) ^ ROTR32(m[i - 15], 18) ^ (m[i - 15] >> 3);
+        uint32_t s1 = ROTR32(m[i - 2], 17) ^ ROTR32(m[i - 2], 19) ^ (m[i - 2] >> 10);
+        m[i] = m[i - 16] + s0 + m[i - 7] + s1;
+    }
+    
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + m[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->bitlen = 0;
+    ctx->datalen = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t len) {
+    // Whole blocks straight from the input when nothing is buffered
+    while (ctx->datalen == 0 && len >= 64) {
+        sha256_transform(ctx, data);
+        ctx->bitlen += 512;
+        data += 64;
+        len -= 64;
+    }
+    for (size_t i = 0; i < len; i++) {
+        ctx->data[ctx->datalen++] = data[i];
+        if (ctx->datalen == 64) {
+            sha256_transform(ctx, ctx->data);
+            ctx->bitlen += 512;
+            ctx->datalen = 0;
+        }
+    }
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t hash[32]) {
+    uint64_t bitlen = ctx->bitlen + (uint64_t)ctx->datalen * 8;
+    uint32_t i = ctx->datalen;
+    
+    ctx->data[i++] = 0x80;
+    if (i > 56) {
+        while (i < 64) ctx->data[i++] = 0;
+        sha256_transform(ctx, ctx->data);
+        i = 0;
+    }
+    while (i < 56) ctx->data[i++] = 0;
+    for (int j = 0; j < 8; j++) {
+        ctx->data[63 - j] = (uint8_t)(bitlen >> (j * 8));
+    }
+    sha256_transform(ctx, ctx->data);
+    
+    for (int j = 0; j < 8; j++) {
+        hash[j * 4] = (uint8_t)(ctx->state[j] >> 24);
+        hash[j * 4 + 1] = (uint8_t)(ctx->state[j] >> 16);
+        hash[j * 4 + 2] = (uint8_t)(ctx->state[j] >> 8);
+        hash[j * 4 + 3] = (uint8_t)ctx->state[j];
+    }
+}
+
+// Persistent content hash index: SHA-256 -> path, validated by dev/inode/size
+// and nanosecond mtime/ctime, so an in-place rewrite within the same second
+// still invalidates the entry.
+// Entries are added as files pass through the server (STOR, DAPPLY, DEDUP) or
+// are hashed by the lazy scan on a DEDUP miss. The on-disk log is only read on
+// first use, so startup cost is zero.
+typedef struct hash_entry {
+    uint8_t sha256[32];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    int32_t mtime_nsec;
+    int32_t ctime_nsec;
+    char *path;
+    struct hash_entry *next;        // Chain by content hash
+    struct hash_entry *path_next;   // Chain by path
+} hash_entry_t;
+
+// On-disk log: hash_index_header_t, then hash_record_t + path per entry.
+// A log with another magic/version is discarded and rebuilt.
+#define HASH_INDEX_MAGIC 0x48355350u    // "PS5H"
+#define HASH_INDEX_VERSION 2
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t version;
+} hash_index_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t sha256[32];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    int32_t mtime_nsec;
+    int32_t ctime_nsec;
+    uint16_t path_len;
+} hash_record_t;
+
+static pthread_mutex_t hash_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static hash_entry_t *hash_index[HASH_INDEX_BUCKETS];
+static hash_entry_t *hash_index_by_path[HASH_INDEX_BUCKETS];
+static int hash_index_loaded = 0;
+static size_t hash_index_live = 0;
+static size_t hash_index_stale = 0;
+
+static unsigned hash_bucket(const uint8_t sha256[32]) {
+    return ((sha256[0] << 8) | sha256[1]) % HASH_INDEX_BUCKETS;
+}
+
+static unsigned hash_path_bucket(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash % HASH_INDEX_BUCKETS;
+}
+
+// 1 = unchanged, 0 = changed, -1 = only the ctime moved. The last happens on
+// every link count change (DEDUP, DELE of a linked copy) but also when a
+// rewrite restored the mtime, so such a file has to be re-hashed.
+static int hash_entry_check(const hash_entry_t *e, const struct stat *st) {
+    if (!S_ISREG(st->st_mode) || (uint64_t)st->st_dev != e->dev || (uint64_t)st->st_ino != e->ino ||
+        (uint64_t)st->st_size != e->size ||
+        (int64_t)st->st_mtim.tv_sec != e->mtime_sec || (int32_t)st->st_mtim.tv_nsec != e->mtime_nsec) {
+        return 0;
+    }
+    if ((int64_t)st->st_ctim.tv_sec != e->ctime_sec || (int32_t)st->st_ctim.tv_nsec != e->ctime_nsec) {
+        return -1;
+    }
+    return 1;
+}
+
+static int hash_entry_valid(const hash_entry_t *e, const struct stat *st) {
+    return hash_entry_check(e, st) == 1;
+}
+
+static hash_entry_t *hash_index_lookup_path_locked(const char *path) {
+    for (hash_entry_t *e = hash_index_by_path[hash_path_bucket(path)]; e; e = e->path_next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void hash_index_drop_locked(hash_entry_t *e) {
+    hash_entry_t **link = &hash_index[hash_bucket(e->sha256)];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    
+    link = &hash_index_by_path[hash_path_bucket(e->path)];
+    while (*link != e) {
+        link = &(*link)->path_next;
+    }
+    *link = e->path_next;
+    
+    free(e->path);
+    free(e);
+    hash_index_live--;
+    hash_index_stale++;
+}
+
+// Insert an entry, replacing any previous one for the same path
+static void hash_index_insert_locked(const hash_record_t *rec, const char *path) {
+    hash_entry_t *old = hash_index_lookup_path_locked(path);
+    if (old) {
+        hash_index_drop_locked(old);
+    }
+    
+    hash_entry_t *e = malloc(sizeof(hash_entry_t));
+    if (!e) {
+        return;
+    }
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return;
+    }
+    memcpy(e->sha256, rec->sha256, 32);
+    e->dev = rec->dev;
+    e->ino = rec->ino;
+    e->size = rec->size;
+    e->mtime_sec = rec->mtime_sec;
+    e->mtime_nsec = rec->mtime_nsec;
+    e->ctime_sec = rec->ctime_sec;
+    e->ctime_nsec = rec->ctime_nsec;
+    
+    unsigned b = hash_bucket(e->sha256);
+    e->next = hash_index[b];
+    hash_index[b] = e;
+    
+    b = hash_path_bucket(e->path);
+    e->path_next = hash_index_by_path[b];
+    hash_index_by_path[b] = e;
+    hash_index_live++;
+}
+
+static void hash_entry_to_record(const hash_entry_t *e, hash_record_t *rec) {
+    memcpy(rec->sha256, e->sha256, 32);
+    rec->dev = e->dev;
+    rec->ino = e->ino;
+    rec->size = e->size;
+    rec->mtime_sec = e->mtime_sec;
+    rec->mtime_nsec = e->mtime_nsec;
+    rec->ctime_sec = e->ctime_sec;
+    rec->ctime_nsec = e->ctime_nsec;
+    rec->path_len = (uint16_t)strlen(e->path);
+}
+
+// Rewrite the log with only live entries once stale ones dominate it
+static void hash_index_compact_locked(void) {
+    char temppath[sizeof(HASH_INDEX_PATH) + 8];
+    snprintf(temppath, sizeof(temppath), "%s.tmp", HASH_INDEX_PATH);
+    
+    FILE *f = fopen(temppath, "wb");
+    if (!f) {
+        return;
+    }
+    hash_index_header_t hdr = { HASH_INDEX_MAGIC, HASH_INDEX_VERSION };
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (int b = 0; b < HASH_INDEX_BUCKETS; b++) {
+        for (hash_entry_t *e = hash_index[b]; e; e = e->next) {
+            hash_record_t rec;
+            hash_entry_to_record(e, &rec);
+            fwrite(&rec, sizeof(rec), 1, f);
+            fwrite(e->path, 1, rec.path_len, f);
+        }
+    }
+    if (fclose(f) == 0 && rename(temppath, HASH_INDEX_PATH) == 0) {
+        hash_index_stale = 0;
+    } else {
+        unlink(temppath);
+    }
+}
+
+static void hash_index_load_locked(void) {
+    hash_index_loaded = 1;
+    
+    FILE *f = fopen(HASH_INDEX_PATH, "rb");
+    if (!f) {
+        return;
+    }
+    
+    hash_index_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != HASH_INDEX_MAGIC || hdr.version != HASH_INDEX_VERSION) {
+        // Empty, damaged or older layout: start over with an empty index
+        fclose(f);
+        hash_index_compact_locked();
+        return;
+    }
+    
+    hash_record_t rec;
+    char path[MAX_PATH];
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.path_len == 0 || rec.path_len >= MAX_PATH || fread(path, 1, rec.path_len, f) != rec.path_len) {
+            break;
+        }
+        path[rec.path_len] = '\0';
+        hash_index_insert_locked(&rec, path);
+    }
+    fclose(f);
+}
+
+void hash_index_add(const char *path, const struct stat *st, const uint8_t sha256[32]) {
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= MAX_PATH) {
+        return;
+    }
+    
+    pthread_mutex_lock(&hash_index_lock);
+    if (!hash_index_loaded) {
+        hash_index_load_locked();
+    }
+    
+    hash_record_t rec;
+    memcpy(rec.sha256, sha256, 32);
+    rec.dev = st->st_dev;
+    rec.ino = st->st_ino;
+    rec.size = st->st_size;
+    rec.mtime_sec = st->st_mtim.tv_sec;
+    rec.mtime_nsec = st->st_mtim.tv_nsec;
+    rec.ctime_sec = st->st_ctim.tv_sec;
+    rec.ctime_nsec = st->st_ctim.tv_nsec;
+    rec.path_len = (uint16_t)path_len;
+    hash_index_insert_locked(&rec, path);
+    
+    FILE *f = fopen(HASH_INDEX_PATH, "ab");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        if (ftell(f) == 0) {
+            hash_index_header_t hdr = { HASH_INDEX_MAGIC, HASH_INDEX_VERSION };
+            fwrite(&hdr, sizeof(hdr), 1, f);
+        }
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(path, 1, path_len, f);
+        fclose(f);
+    }
+    
+    if (hash_index_stale > 64 && hash_index_stale > hash_index_live) {
+        hash_index_compact_locked();
+    }
+    pthread_mutex_unlock(&hash_index_lock);
+}
+
+// Is there a current hash for this path (same inode, size and mtime)?
+static int hash_index_known(const char *path, const struct stat *st) {
+    pthread_mutex_lock(&hash_index_lock);
+    if (!hash_index_loaded) {
+        hash_index_load_locked();
+    }
+    hash_entry_t *e = hash_index_lookup_path_locked(path);
+    int known = e && hash_entry_valid(e, st);
+    pthread_mutex_unlock(&hash_index_lock);
+    return known;
+}
+
+// SHA-256 of a whole file; st is refreshed and must not change while reading
+static int hash_file_sha256(const char *path, struct stat *st, uint8_t out[32]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat before;
+    uint8_t *buffer = malloc(BUFFER_SIZE);
+    int result = (buffer && fstat(fd, &before) == 0) ? 0 : -1;
+    
+    sha256_ctx_t sha;
+    sha256_init(&sha);
+    ssize_t n;
+    while (result == 0 && (n = read(fd, buffer, BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+        } else {
+            sha256_update(&sha, buffer, n);
+        }
+    }
+    if (result == 0 && (fstat(fd, st) < 0 || st->st_size != before.st_size ||
+                        st->st_mtim.tv_sec != before.st_mtim.tv_sec || st->st_mtim.tv_nsec != before.st_mtim.tv_nsec ||
+                        st->st_ctim.tv_sec != before.st_ctim.tv_sec || st->st_ctim.tv_nsec != before.st_ctim.tv_nsec)) {
+        result = -1;
+    }
+    if (result == 0) {
+        sha256_final(&sha, out);
+    }
+    
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Find a still-valid file with the given content; stale entries are dropped on the way.
+// A candidate whose ctime alone moved is re-hashed outside the lock.
+int hash_index_find(uint64_t size, const uint8_t sha256[32], char *out_path, size_t out_size) {
+    int found = 0;
+    char verify[MAX_PATH] = {0};
+    
+    pthread_mutex_lock(&hash_index_lock);
+    if (!hash_index_loaded) {
+        hash_index_load_locked();
+    }
+    
+    hash_entry_t *next;
+    for (hash_entry_t *e = hash_index[hash_bucket(sha256)]; e && !found; e = next) {
+        next = e->next;
+        if (e->size != size || memcmp(e->sha256, sha256, 32) != 0) {
+            continue;
+        }
+        
+        struct stat st;
+        int check = stat(e->path, &st) == 0 ? hash_entry_check(e, &st) : 0;
+        if (check == 1) {
+            snprintf(out_path, out_size, "%s", e->path);
+            found = 1;
+        } else if (check < 0 && !verify[0]) {
+            snprintf(verify, sizeof(verify), "%s", e->path);
+        } else if (check == 0) {
+            hash_index_drop_locked(e);
+        }
+    }
+    pthread_mutex_unlock(&hash_index_lock);
+    
+    if (!found && verify[0]) {
+        struct stat st;
+        uint8_t actual[32];
+        if (hash_file_sha256(verify, &st, actual) == 0) {
+            hash_index_add(verify, &st, actual);
+            if ((uint64_t)st.st_size == size && memcmp(actual, sha256, 32) == 0) {
+                snprintf(out_path, out_size, "%s", verify);
+                found = 1;
+            }
+        }
+    }
+    
+    return found;
+}
+
+// Lazy scan for DEDUP misses. The first miss starts a background walk of
+// HASH_SCAN_ROOTS that records the size of every large file (no hashing) and
+// is repeated at most every HASH_SCAN_INTERVAL seconds. Misses reply at once
+// until the catalog exists; after that a miss hashes only the not-yet-indexed
+// files of the announced size. Hashes go into the index, so files that never
+// passed through the server become findable and each one is read at most
+// once while it stays unchanged.
+typedef struct {
+    uint64_t size;
+    char *path;
+} scan_file_t;
+
+static pthread_mutex_t hash_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static scan_file_t *hash_scan_files = NULL;     // Sorted by size
+static size_t hash_scan_count = 0;
+static time_t hash_scan_time = 0;
+static int hash_scan_running = 0;
+
+static int scan_file_compare(const void *a, const void *b) {
+    uint64_t x = ((const scan_file_t *)a)->size;
+    uint64_t y = ((const scan_file_t *)b)->size;
+    return x < y ? -1 : x > y;
+}
+
+static void scan_files_free(scan_file_t *files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(files[i].path);
+    }
+    free(files);
+}
+
+// Walk the roots without holding any lock; returns the number of files found
+static size_t hash_scan_build(scan_file_t **out) {
+    static const char *roots[] = { HASH_SCAN_ROOTS };
+    scan_file_t *files = NULL;
+    size_t count = 0, files_cap = 0;
+    
+    // Explicit directory stack instead of recursion
+    char **stack = NULL;
+    size_t depth = 0, stack_cap = 0;
+    for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+        if (depth == stack_cap) {
+            stack_cap = stack_cap ? stack_cap * 2 : 64;
+            char **grown = realloc(stack, stack_cap * sizeof(char *));
+            if (!grown) break;
+            stack = grown;
+        }
+        if ((stack[depth] = strdup(roots[i])) != NULL) depth++;
+    }
+    
+    while (depth > 0) {
+        char *dir = stack[--depth];
+        DIR *d = count < HASH_SCAN_MAX_FILES ? opendir(dir) : NULL;
+        struct dirent *entry;
+        while (d && (entry = readdir(d)) != NULL && count < HASH_SCAN_MAX_FILES) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char path[MAX_PATH];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+                continue;
+            }
+            
+            // lstat: never follow symlinks out of (or in circles around) the roots
+            struct stat st;
+            if (lstat(path, &st) < 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                if (depth == stack_cap) {
+                    char **grown = realloc(stack, stack_cap * 2 * sizeof(char *));
+                    if (!grown) continue;
+                    stack = grown;
+                    stack_cap *= 2;
+                }
+                if ((stack[depth] = strdup(path)) != NULL) depth++;
+            } else if (S_ISREG(st.st_mode) && st.st_size >= HASH_SCAN_MIN_SIZE) {
+                if (count == files_cap) {
+                    size_t cap = files_cap ? files_cap * 2 : 256;
+                    scan_file_t *grown = realloc(files, cap * sizeof(scan_file_t));
+                    if (!grown) continue;
+                    files = grown;
+                    files_cap = cap;
+                }
+                char *copy = strdup(path);
+                if (copy) {
+                    files[count].size = st.st_size;
+                    files[count].path = copy;
+                    count++;
+                }
+            }
+        }
+        if (d) closedir(d);
+        free(dir);
+    }
+    free(stack);
+    
+    if (count > 0) {
+        qsort(files, count, sizeof(scan_file_t), scan_file_compare);
+    }
+    *out = files;
+    return count;
+}
+
+static void* hash_scan_worker(void* arg) {
+    scan_file_t *files;
+    size_t count = hash_scan_build(&files);
+    
+    pthread_mutex_lock(&hash_scan_lock);
+    scan_file_t *old_files = hash_scan_files;
+    size_t old_count = hash_scan_count;
+    hash_scan_files = files;
+    hash_scan_count = count;
+    hash_scan_time = time(NULL);
+    hash_scan_running = 0;
+    pthread_mutex_unlock(&hash_scan_lock);
+    
+    scan_files_free(old_files, old_count);
+    return NULL;
+}
+
+static void hash_scan_start_locked(void) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    hash_scan_running = pthread_create(&thread, &attr, hash_scan_worker, NULL) == 0;
+    pthread_attr_destroy(&attr);
+}
+
+int hash_index_scan(uint64_t size, const uint8_t sha256[32], char *out_path, size_t out_size) {
+    if (size < HASH_SCAN_MIN_SIZE) {
+        return 0;
+    }
+    
+    // Copy the candidate paths out; stat and hashing happen without the lock
+    char **candidates = NULL;
+    size_t count = 0;
+    
+    pthread_mutex_lock(&hash_scan_lock);
+    if (!hash_scan_running && (hash_scan_time == 0 || time(NULL) - hash_scan_time > HASH_SCAN_INTERVAL)) {
+        hash_scan_start_locked();
+    }
+    
+    // First catalog entry of the announced size
+    size_t lo = 0, hi = hash_scan_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hash_scan_files[mid].size < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    hi = lo;
+    while (hi < hash_scan_count && hash_scan_files[hi].size == size) {
+        hi++;
+    }
+    if (hi > lo && (candidates = malloc((hi - lo) * sizeof(char *))) != NULL) {
+        for (size_t i = lo; i < hi; i++) {
+            if ((candidates[count] = strdup(hash_scan_files[i].path)) != NULL) count++;
+        }
+    }
+    pthread_mutex_unlock(&hash_scan_lock);
+    
+    int found = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *path = candidates[i];
+        struct stat st;
+        uint8_t actual[32];
+        if (found || stat(path, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != size ||
+            hash_index_known(path, &st) || hash_file_sha256(path, &st, actual) < 0) {
+            continue;
+        }
+        hash_index_add(path, &st, actual);
+        if (memcmp(actual, sha256, 32) == 0) {
+            snprintf(out_path, out_size, "%s", path);
+            found = 1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(candidates[i]);
+    }
+    free(candidates);
+    
+    return found;
+}
+
+void send_response(int sock, const char *response) {
+    if (response[0] >= '0' && response[0] <= '9') {
+        last_reply_code = atoi(response);
+    }
+    
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s\r\n", response);
+    send(sock, buffer, strlen(buffer), 0);
+}
+
+void send_error_response(int sock, int code, const char *msg) {
+    char response[256];
+    if (errno != 0) {
+        snprintf(response, sizeof(response), "%d %s (Error: %s)", code, msg, strerror(errno));
+    } else {
+        snprintf(response, sizeof(response), "%d %s", code, msg);
+    }
+    send_response(sock, response);
+}
+
+static int send_all(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (w == 0) return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Unique sibling name for a temporary file; callers create it exclusively
+// (O_EXCL or link()) and retry on EEXIST, so sessions never share a temp inode
+static void temp_path_name(const char *path, const char *tag, char *out, size_t out_size) {
+    static volatile uint32_t temp_counter = 0;
+    uint32_t n = __sync_fetch_and_add(&temp_counter, 1);
+    snprintf(out, out_size, "%s.%s.%lx.%x", path, tag, (unsigned long)time(NULL), n);
+}
+
+static int create_temp_file(const char *path, const char *tag, mode_t mode, char *out, size_t out_size) {
+    for (int attempt = 0; attempt < 16; attempt++) {
+        temp_path_name(path, tag, out, out_size);
+        int fd = open(out, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Copy src to dst via a temporary file so dst never appears half-written.
+// src and dst may be the same path (see break_hard_link).
+static int copy_file(const char *src, const char *dst, mode_t mode) {
+    char temppath[MAX_PATH + 32];
+    
+    int in_fd = open(src, O_RDONLY);
+    if (in_fd < 0) {
+        return -1;
+    }
+    int out_fd = create_temp_file(dst, "copy", 0600, temppath, sizeof(temppath));
+    if (out_fd < 0) {
+        close(in_fd);
+        return -1;
+    }
+    
+    char *buffer = malloc(BUFFER_SIZE);
+    int result = buffer ? 0 : -1;
+    ssize_t n;
+    while (result == 0 && (n = read(in_fd, buffer, BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+        } else if (write_all(out_fd, buffer, n) < 0) {
+            result = -1;
+        }
+    }
+    
+    free(buffer);
+    close(in_fd);
+    if (result == 0 && fchmod(out_fd, mode) < 0) {
+        result = -1;
+    }
+    if (close(out_fd) < 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temppath, dst) < 0) {
+        result = -1;
+    }
+    if (result < 0) {
+        unlink(temppath);
+    }
+    return result;
+}
+
+// SITE DEDUP hard-links identical files, so a path may share its inode with
+// others. Give it a private copy before anything modifies the inode in place.
+static int break_hard_link(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink <= 1) {
+        return 0;
+    }
+    return copy_file(path, path, st.st_mode & 07777);
+}
+
+void trace_open(ftp_session_t *session, const struct sockaddr_in *client_addr) {
+    session->trace = NULL;
+    if (!trace_enabled) {
+        return;
+    }
+    
+    mkdir(TRACE_DIR, 0755);
+    
+    // Sessions starting in the same second can reuse a socket number, so
+    // the name also carries a counter and is created exclusively
+    static volatile uint32_t trace_counter = 0;
+    char path[MAX_PATH];
+    int fd = -1;
+    for (int attempt = 0; attempt < 16 && fd < 0; attempt++) {
+        uint32_t n = __sync_fetch_and_add(&trace_counter, 1);
+        snprintf(path, sizeof(path), "%s/session_%lld_%d_%u.trc",
+                 TRACE_DIR, (long long)time(NULL), session->control_sock, n);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 && errno != EEXIST) {
+            return;
+        }
+    }
+    if (fd < 0) {
+        return;
+    }
+    
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        return;
+    }
+    setvbuf(f, NULL, _IOFBF, TRACE_FILE_BUFFER);
+    
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.start_time = (uint64_t)time(NULL);
+    hdr.client_ip = client_addr->sin_addr.s_addr;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    
+    session->trace = f;
+    session->trace_start_us = now_us();
+}
+
+void trace_command(ftp_session_t *session, const char *cmd, const char *line, uint64_t start_us) {
+    if (!session->trace) {
+        return;
+    }
+    
+    // Never write passwords to disk
+    if (strcmp(cmd, "PASS") == 0) {
+        line = "PASS";
+    }
+    
+    size_t line_len = strlen(line);
+    if (line_len > TRACE_MAX_LINE) {
+        line_len = TRACE_MAX_LINE;
+    }
+    
+    trace_record_t rec;
+    rec.t_us = start_us - session->trace_start_us;
+    rec.latency_us = now_us() - start_us;
+    rec.data_bytes = session->transfer_bytes;
+    rec.reply_code = (uint16_t)last_reply_code;
+    rec.line_len = (uint16_t)line_len;
+    
+    fwrite(&rec, sizeof(rec), 1, session->trace);
+    fwrite(line, 1, line_len, session->trace);
+}
+
+void trace_close(ftp_session_t *session) {
+    if (session->trace) {
+        fclose(session->trace);
+        session->trace = NULL;
+    }
+}
+
+// Read-ahead sized to what the link drains in READAHEAD_WINDOW_MS
+static off_t readahead_size(void) {
+    uint64_t bytes = stats.link_rate * READAHEAD_WINDOW_MS / 1000;
+    if (bytes < READAHEAD_MIN) bytes = READAHEAD_MIN;
+    if (bytes > READAHEAD_MAX) bytes = READAHEAD_MAX;
+    return (off_t)bytes;
+}
+
+void readahead_apply(int fd, off_t offset, off_t length) {
+    off_t window = readahead_size();
+    
+    #ifdef F_READAHEAD
+    fcntl(fd, F_READAHEAD, (int)window);
+    #endif
+    #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, offset, length - offset, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, offset, window, POSIX_FADV_WILLNEED);
+    #endif
+    
+    __sync_fetch_and_add(&stats.readahead_hints, 1);
+}
+
+void link_rate_update(uint64_t bytes, uint64_t elapsed_us) {
+    // Short transfers say more about latency than bandwidth
+    if (bytes < READAHEAD_MIN || elapsed_us == 0) {
+        return;
+    }
+    uint64_t rate = bytes * 1000000 / elapsed_us;
+    uint64_t old = stats.link_rate;
+    stats.link_rate = old ? (old * 3 + rate) / 4 : rate;
+}
+
+typedef struct {
+    char path[MAX_PATH];
+    off_t bytes;
+} prefetch_job_t;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t prefetch_once = PTHREAD_ONCE_INIT;
+static prefetch_job_t prefetch_queue[PREFETCH_QUEUE_LEN];
+static int prefetch_head = 0;
+static int prefetch_count = 0;
+static char prefetch_recent[PREFETCH_RECENT][MAX_PATH];  // Warmed, not yet downloaded
+static int prefetch_recent_next = 0;
+static int prefetch_thread_ok = 0;
+
+static void* prefetch_worker(void* arg) {
+    char *buffer = malloc(READAHEAD_MIN);
+    if (!buffer) {
+        return NULL;
+    }
+    
+    while (1) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_count == 0) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        prefetch_job_t job = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_LEN;
+        prefetch_count--;
+        pthread_mutex_unlock(&prefetch_lock);
+        
+        int fd = open(job.path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        
+        #ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, 0, job.bytes, POSIX_FADV_WILLNEED);
+        #endif
+        
+        // Actually read it: on USB/exFAT the hint alone may not start any I/O
+        off_t done = 0;
+        ssize_t n;
+        while (done < job.bytes && (n = pread(fd, buffer, READAHEAD_MIN, done)) > 0) {
+            done += n;
+        }
+        close(fd);
+        
+        __sync_fetch_and_add(&stats.prefetch_bytes, (uint64_t)done);
+        
+        pthread_mutex_lock(&prefetch_lock);
+        strcpy(prefetch_recent[prefetch_recent_next], job.path);
+        prefetch_recent_next = (prefetch_recent_next + 1) % PREFETCH_RECENT;
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    
+    return NULL;
+}
+
+static void prefetch_start(void) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    prefetch_thread_ok = pthread_create(&thread, &attr, prefetch_worker, NULL) == 0;
+    pthread_attr_destroy(&attr);
+}
+
+void prefetch_request(const char *path, off_t bytes) {
+    pthread_once(&prefetch_once, prefetch_start);
+    if (!prefetch_thread_ok) {
+        return;
+    }
+    
+    pthread_mutex_lock(&prefetch_lock);
+    int known = 0;
+    for (int i = 0; i < PREFETCH_RECENT && !known; i++) {
+        known = strcmp(prefetch_recent[i], path) == 0;
+    }
+    for (int i = 0; i < prefetch_count && !known; i++) {
+        known = strcmp(prefetch_queue[(prefetch_head + i) % PREFETCH_QUEUE_LEN].path, path) == 0;
+    }
+    if (!known && prefetch_count < PREFETCH_QUEUE_LEN) {
+        prefetch_job_t *job = &prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE_LEN];
+        snprintf(job->path, sizeof(job->path), "%s", path);
+        job->bytes = bytes;
+        prefetch_count++;
+        __sync_fetch_and_add(&stats.prefetch_issued, 1);
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Count a hit when a download was warmed by the prefetcher
+void prefetch_note_retr(const char *path) {
+    pthread_mutex_lock(&prefetch_lock);
+    for (int i = 0; i < PREFETCH_RECENT; i++) {
+        if (strcmp(prefetch_recent[i], path) == 0) {
+            prefetch_recent[i][0] = '\0';
+            __sync_fetch_and_add(&stats.prefetch_hits, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+void listing_free(ftp_session_t *session) {
+    for (int i = 0; i < session->listing_count; i++) {
+        free(session->listing[i]);
+    }
+    free(session->listing);
+    session->listing = NULL;
+    session->listing_count = 0;
+    session->last_retr_index = -1;
+}
+
+static void listing_add(ftp_session_t *session, const char *name) {
+    if (session->listing_count >= PREFETCH_LIST_MAX) {
+        return;
+    }
+    if ((session->listing_count & 63) == 0) {
+        char **grown = realloc(session->listing, (session->listing_count + 64) * sizeof(char*));
+        if (!grown) {
+            return;
+        }
+        session->listing = grown;
+    }
+    char *copy = strdup(name);
+    if (copy) {
+        session->listing[session->listing_count++] = copy;
+    }
+}
+
+// Clients fetch a batch in listing order (or reverse), so warm the neighbour
+// of the file being downloaded while it is still going out
+void prefetch_next(ftp_session_t *session, const char *filename) {
+    if (session->listing_count == 0 || strcmp(session->listing_dir, session->current_dir) != 0) {
+        return;
+    }
+    
+    int index = -1;
+    for (int i = 0; i < session->listing_count; i++) {
+        if (strcmp(session->listing[i], filename) == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) {
+        return;
+    }
+    
+    int direction = (session->last_retr_index == index + 1) ? -1 : 1;
+    session->last_retr_index = index;
+    
+    int next = index + direction;
+    if (next < 0 || next >= session->listing_count) {
+        return;
+    }
+    
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s/%s", session->current_dir, session->listing[next]);
+    
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        prefetch_request(path, st.st_size < PREFETCH_WARM_MAX ? st.st_size : PREFETCH_WARM_MAX);
+    }
+}
+
+// Hot cache: entries are keyed by dev/inode and validated against size and
+// nanosecond mtime on every lookup, so a stat() replaces open/fstat/sendfile.
+// Evicted buffers stay alive until the last sender drops its reference.
+#define HOT_FILE 0
+#define HOT_LISTING 1
+
+typedef struct {
+    int refs;
+    size_t len;
+    size_t names_len;       // Listings: NUL-terminated regular-file names follow the reply
+    char data[];
+} hot_blob_t;
+
+typedef struct {
+    hot_blob_t *blob;       // NULL = free slot
+    int kind;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    time_t stored;
+    int referenced;         // CLOCK bit
+} hot_entry_t;
+
+static pthread_mutex_t hot_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static hot_entry_t hot_cache[HOT_CACHE_SLOTS];
+static size_t hot_cache_bytes = 0;
+static int hot_cache_hand = 0;
+
+static int hot_entry_matches(const hot_entry_t *e, int kind, const struct stat *st) {
+    return e->blob && e->kind == kind && e->dev == (uint64_t)st->st_dev && e->ino == (uint64_t)st->st_ino;
+}
+
+static void hot_blob_unref_locked(hot_blob_t *blob) {
+    if (--blob->refs == 0) {
+        free(blob);
+    }
+}
+
+static void hot_entry_drop_locked(hot_entry_t *e) {
+    hot_cache_bytes -= e->blob->len + e->blob->names_len;
+    hot_blob_unref_locked(e->blob);
+    e->blob = NULL;
+}
+
+void hot_blob_release(hot_blob_t *blob) {
+    pthread_mutex_lock(&hot_cache_lock);
+    hot_blob_unref_locked(blob);
+    pthread_mutex_unlock(&hot_cache_lock);
+}
+
+// Returns a referenced buffer, or NULL on miss; release with hot_blob_release()
+hot_blob_t *hot_cache_get(int kind, const struct stat *st) {
+    if (HOT_CACHE_SIZE == 0) {
+        return NULL;
+    }
+    
+    hot_blob_t *blob = NULL;
+    pthread_mutex_lock(&hot_cache_lock);
+    for (int i = 0; i < HOT_CACHE_SLOTS; i++) {
+        hot_entry_t *e = &hot_cache[i];
+        if (!hot_entry_matches(e, kind, st)) {
+            continue;
+        }
+        int fresh = e->mtime_sec == (int64_t)st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec;
+        if (kind == HOT_FILE) {
+            fresh = fresh && e->size == (uint64_t)st->st_size;
+        } else {
+            fresh = fresh && time(NULL) - e->stored < HOT_CACHE_LIST_TTL;
+        }
+        if (fresh) {
+            e->referenced = 1;
+            blob = e->blob;
+            blob->refs++;
+        } else {
+            hot_entry_drop_locked(e);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
+    
+    __sync_fetch_and_add(blob ? &stats.cache_hits : &stats.cache_misses, 1);
+    return blob;
+}
+
+void hot_cache_put(int kind, const struct stat *st, const char *data, size_t len,
+                   const char *names, size_t names_len) {
+    if (HOT_CACHE_SIZE == 0 || len > HOT_CACHE_FILE_MAX || len + names_len > HOT_CACHE_SIZE) {
+        return;
+    }
+    
+    hot_blob_t *blob = malloc(sizeof(hot_blob_t) + len + names_len);
+    if (!blob) {
+        return;
+    }
+    blob->refs = 1;
+    blob->len = len;
+    blob->names_len = names_len;
+    memcpy(blob->data, data, len);
+    if (names_len > 0) {
+        memcpy(blob->data + len, names, names_len);
+    }
+    len += names_len;
+    
+    pthread_mutex_lock(&hot_cache_lock);
+    for (int i = 0; i < HOT_CACHE_SLOTS; i++) {
+        if (hot_entry_matches(&hot_cache[i], kind, st)) {
+            hot_entry_drop_locked(&hot_cache[i]);
+        }
+    }
+    
+    // CLOCK: sweep, giving referenced entries a second chance, until there is
+    // a free slot and room for the new buffer
+    hot_entry_t *slot = NULL;
+    for (int sweeps = 0; sweeps < HOT_CACHE_SLOTS * 2 + 1; sweeps++) {
+        hot_entry_t *e = &hot_cache[hot_cache_hand];
+        hot_cache_hand = (hot_cache_hand + 1) % HOT_CACHE_SLOTS;
+        
+        if (e->blob && e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        if (e->blob) {
+            hot_entry_drop_locked(e);
+        }
+        if (!slot) {
+            slot = e;
+        }
+        if (hot_cache_bytes + len <= HOT_CACHE_SIZE) {
+            break;
+        }
+    }
+    
+    if (slot && !slot->blob && hot_cache_bytes + len <= HOT_CACHE_SIZE) {
+        slot->blob = blob;
+        slot->kind = kind;
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+        slot->size = st->st_size;
+        slot->mtime_sec = st->st_mtim.tv_sec;
+        slot->mtime_nsec = st->st_mtim.tv_nsec;
+        slot->stored = time(NULL);
+        slot->referenced = 0;
+        hot_cache_bytes += len;
+    } else {
+        hot_blob_unref_locked(blob);
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
+}
+
+static void hot_cache_drop(const struct stat *st) {
+    pthread_mutex_lock(&hot_cache_lock);
+    for (int i = 0; i < HOT_CACHE_SLOTS; i++) {
+        hot_entry_t *e = &hot_cache[i];
+        if (e->blob && e->dev == (uint64_t)st->st_dev && e->ino == (uint64_t)st->st_ino) {
+            hot_entry_drop_locked(e);
+        }
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
+}
 
-int sceKernelSendNotificationRequest(int, notify_request_t*, size_t, int);
+// Forget a path and the listing of its directory. Call before removing
+// something and after creating or rewriting it.
+void hot_cache_invalidate_path(const char *path) {
+    if (HOT_CACHE_SIZE == 0) {
+        return;
+    }
+    
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        hot_cache_drop(&st);
+    }
+    
+    char parent[MAX_PATH];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *slash = strrchr(parent, '/');
+    if (slash) {
+        if (slash == parent) slash++;
+        *slash = '\0';
+        if (stat(parent, &st) == 0) {
+            hot_cache_drop(&st);
+        }
+    }
+}
 
-void send_notification(const char *msg) {
-    notify_request_t req;
-    memset(&req, 0, sizeof(req));
-    strncpy(req.message, msg, sizeof(req.message) - 1);
-    sceKernelSendNotificationRequest(0, &req, sizeof(req), 0);
+void hot_cache_usage(size_t *bytes, int *entries) {
+    pthread_mutex_lock(&hot_cache_lock);
+    *bytes = hot_cache_bytes;
+    *entries = 0;
+    for (int i = 0; i < HOT_CACHE_SLOTS; i++) {
+        if (hot_cache[i].blob) (*entries)++;
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
 }
 
+// Change journal: every mutation gets the next sequence number in a bounded
+// ring. A token is "<server start time>:<sequence>", so tokens from an older
+// server run or from before the oldest kept entry are refused.
 typedef struct {
-    int control_sock;
-    int data_sock;
-    int data_port;
-    char current_dir[MAX_PATH];
-    char rename_from[MAX_PATH];
-    int passive_mode;
-    off_t restart_offset;
-    struct sockaddr_in data_addr;
-} ftp_session_t;
+    uint64_t seq;
+    const char *op;
+    char *path;
+    uint32_t path_hash;     // Cheap pre-check before strcmp when deduplicating
+} change_entry_t;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static change_entry_t journal[CHANGE_JOURNAL_SIZE];
+static uint64_t journal_seq = 0;        // Last sequence number handed out
+static time_t journal_epoch = 0;
+
+void journal_record(const char *op, const char *path) {
+    // Paths are built as dir + "/" + name; collapse the doubled slashes
+    char clean[MAX_PATH];
+    size_t len = 0;
+    for (const char *p = path; *p && len < sizeof(clean) - 1; p++) {
+        if (*p == '/' && len > 0 && clean[len - 1] == '/') continue;
+        clean[len++] = *p;
+    }
+    clean[len] = '\0';
+    
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)clean[i]) * 16777619u;
+    }
+    
+    char *copy = strdup(clean);
+    if (!copy) {
+        return;
+    }
+    
+    pthread_mutex_lock(&journal_lock);
+    if (journal_epoch == 0) {
+        journal_epoch = time(NULL);
+    }
+    change_entry_t *e = &journal[++journal_seq % CHANGE_JOURNAL_SIZE];
+    free(e->path);
+    e->seq = journal_seq;
+    e->op = op;
+    e->path = copy;
+    e->path_hash = hash;
+    pthread_mutex_unlock(&journal_lock);
+}
 
+void journal_token(char *out, size_t out_size) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_epoch == 0) {
+        journal_epoch = time(NULL);
+    }
+    snprintf(out, out_size, "%lld:%llu", (long long)journal_epoch, (unsigned long long)journal_seq);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Tokens are "<epoch>:<seq>" with nothing after them
+int journal_parse_token(const char *token, long long *epoch, uint64_t *since) {
+    unsigned long long seq;
+    int used = 0;
+    if (sscanf(token, "%lld:%llu%n", epoch, &seq, &used) != 2 || token[used] != '\0') {
+        return -1;
+    }
+    *since = seq;
+    return 0;
+}
+
+// Render every path changed after the token, once each with its latest
+// operation, oldest first. Returns -1 if the token can no longer be served.
+int journal_changes_since(long long epoch, uint64_t since, char **out, size_t *out_len, uint64_t *last_seq) {
+    // Copy the entries out under the lock; deduplicate and render after
+    pthread_mutex_lock(&journal_lock);
+    if (journal_epoch == 0) {
+        journal_epoch = time(NULL);
+    }
+    uint64_t oldest = journal_seq >= CHANGE_JOURNAL_SIZE ? journal_seq - CHANGE_JOURNAL_SIZE + 1 : 1;
+    if (epoch != (long long)journal_epoch || since > journal_seq || since + 1 < oldest) {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    
+    size_t count = journal_seq - since;
+    change_entry_t *entries = malloc((count ? count : 1) * sizeof(change_entry_t));
+    size_t copied = 0;
+    if (entries) {
+        // entries[0] is the newest
+        for (; copied < count; copied++) {
+            const change_entry_t *e = &journal[(journal_seq - copied) % CHANGE_JOURNAL_SIZE];
+            entries[copied] = *e;
+            entries[copied].path = strdup(e->path);
+            if (!entries[copied].path) break;
+        }
+    }
+    *last_seq = journal_seq;
+    pthread_mutex_unlock(&journal_lock);
+    
+    if (!entries || copied < count) {
+        for (size_t i = 0; i < copied; i++) {
+            free(entries[i].path);
+        }
+        free(entries);
+        return -1;
+    }
+    
+    // Open-addressing set of paths already seen, walking newest first, so
+    // each path keeps only its latest entry
+    size_t slots = 16;
+    while (slots < count * 2) slots *= 2;
+    uint32_t *seen = calloc(slots, sizeof(uint32_t));     // entry index + 1, 0 = empty
+    uint8_t *skip = calloc(count ? count : 1, 1);
+    size_t cap = count * 64 + 1;
+    char *buffer = malloc(cap);
+    size_t len = 0;
+    int complete = seen && skip && buffer;
+    
+    if (complete) {
+        for (size_t i = 0; i < count; i++) {
+            size_t slot = entries[i].path_hash & (slots - 1);
+            while (seen[slot]) {
+                const change_entry_t *newer = &entries[seen[slot] - 1];
+                if (newer->path_hash == entries[i].path_hash && strcmp(newer->path, entries[i].path) == 0) {
+                    skip[i] = 1;
+                    break;
+                }
+                slot = (slot + 1) & (slots - 1);
+            }
+            if (!skip[i]) {
+                seen[slot] = (uint32_t)i + 1;
+            }
+        }
+        for (size_t i = count; i-- > 0; ) {
+            if (skip[i]) continue;
+            const change_entry_t *e = &entries[i];
+            size_t need = strlen(e->path) + 40;
+            if (len + need > cap) {
+                char *grown = realloc(buffer, cap * 2 + need);
+                if (!grown) {
+                    // A partial list would hand out a token past the missing changes
+                    complete = 0;
+                    break;
+                }
+                buffer = grown;
+                cap = cap * 2 + need;
+            }
+            len += snprintf(buffer + len, cap - len, "%llu %s %s\r\n",
+                            (unsigned long long)e->seq, e->op, e->path);
+        }
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    free(seen);
+    free(skip);
+    if (!complete) {
+        free(buffer);
+        return -1;
+    }
+    *out = buffer;
+    *out_len = len;
+    return 0;
+}
+
+#ifdef __FreeBSD__
+// kqueue directory watches: catch changes made outside the FTP server.
+// kqueue reports that a directory changed but not which entry, so the
+// directory itself is journaled and the client rescans just that one.
 typedef struct {
-    int client_sock;
-    struct sockaddr_in client_addr;
-} client_info_t;
+    int fd;
+    char path[MAX_PATH];
+} change_watch_t;
 
-void send_response(int sock, const char *response) {
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer), "%s\r\n", response);
-    send(sock, buffer, strlen(buffer), 0);
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static change_watch_t watches[CHANGE_WATCH_MAX];
+static int watch_kq = -1;
+
+static void* watch_thread(void* arg) {
+    struct kevent events[16];
+    
+    while (1) {
+        int n = kevent(watch_kq, NULL, 0, events, 16, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            change_watch_t *w = (change_watch_t*)events[i].udata;
+            
+            pthread_mutex_lock(&watch_lock);
+            if (w->fd >= 0) {
+                journal_record("CHANGED", w->path);
+                // The directory itself is gone; its watch is useless now
+                if (events[i].fflags & (NOTE_DELETE | NOTE_RENAME)) {
+                    close(w->fd);
+                    w->fd = -1;
+                }
+            }
+            pthread_mutex_unlock(&watch_lock);
+        }
+    }
+    return NULL;
 }
 
-void send_error_response(int sock, int code, const char *msg) {
-    char response[256];
-    if (errno != 0) {
-        snprintf(response, sizeof(response), "%d %s (Error: %s)", code, msg, strerror(errno));
-    } else {
-        snprintf(response, sizeof(response), "%d %s", code, msg);
+// Returns 0 on success, -1 if the directory cannot be watched
+int watch_add(const char *path) {
+    int result = -1;
+    
+    pthread_mutex_lock(&watch_lock);
+    if (watch_kq < 0) {
+        for (int i = 0; i < CHANGE_WATCH_MAX; i++) {
+            watches[i].fd = -1;
+        }
+        watch_kq = kqueue();
+        
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (watch_kq >= 0 && pthread_create(&thread, &attr, watch_thread, NULL) != 0) {
+            close(watch_kq);
+            watch_kq = -1;
+        }
+        pthread_attr_destroy(&attr);
     }
-    send_response(sock, response);
+    
+    change_watch_t *slot = NULL;
+    for (int i = 0; i < CHANGE_WATCH_MAX && watch_kq >= 0; i++) {
+        if (watches[i].fd >= 0 && strcmp(watches[i].path, path) == 0) {
+            slot = NULL;
+            result = 0;
+            break;
+        }
+        if (watches[i].fd < 0 && !slot) {
+            slot = &watches[i];
+        }
+    }
+    
+    if (slot) {
+        int fd = open(path, O_RDONLY);
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, slot);
+        if (fd >= 0 && kevent(watch_kq, &ev, 1, NULL, 0, NULL) == 0) {
+            slot->fd = fd;
+            snprintf(slot->path, sizeof(slot->path), "%s", path);
+            result = 0;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    
+    return result;
+}
+#endif
+
+void handle_site_stats(ftp_session_t *session) {
+    char line[128];
+    uint64_t issued = stats.prefetch_issued;
+    uint64_t hits = stats.prefetch_hits;
+    
+    send_response(session->control_sock, "211-Server statistics:");
+    snprintf(line, sizeof(line), " Downloads: %llu (%.1f MB)",
+             (unsigned long long)stats.downloads, stats.download_bytes / (1024.0 * 1024.0));
+    send_response(session->control_sock, line);
+    snprintf(line, sizeof(line), " Link rate: %.2f MB/s, read-ahead window: %lld KB (%llu hints)",
+             stats.link_rate / (1024.0 * 1024.0), (long long)readahead_size() / 1024,
+             (unsigned long long)stats.readahead_hints);
+    send_response(session->control_sock, line);
+    snprintf(line, sizeof(line), " Prefetch: %llu issued, %llu hits (%.1f%%), %.1f MB warmed",
+             (unsigned long long)issued, (unsigned long long)hits,
+             issued ? hits * 100.0 / issued : 0.0, stats.prefetch_bytes / (1024.0 * 1024.0));
+    send_response(session->control_sock, line);
+    
+    size_t cache_bytes;
+    int cache_entries;
+    uint64_t cache_hits = stats.cache_hits;
+    uint64_t cache_lookups = cache_hits + stats.cache_misses;
+    hot_cache_usage(&cache_bytes, &cache_entries);
+    snprintf(line, sizeof(line), " Hot cache: %d entries, %.1f/%d MB, %llu hits (%.1f%%), %.1f MB served from memory",
+             cache_entries, cache_bytes / (1024.0 * 1024.0), HOT_CACHE_SIZE / (1024 * 1024),
+             (unsigned long long)cache_hits, cache_lookups ? cache_hits * 100.0 / cache_lookups : 0.0,
+             stats.cache_bytes_served / (1024.0 * 1024.0));
+    send_response(session->control_sock, line);
+    send_response(session->control_sock, "211 End");
 }
 
 void handle_user(ftp_session_t *session, const char *arg) {
@@ -111,53 +1707,170 @@ void handle_type(ftp_session_t *session, const char *type) {
     send_response(session->control_sock, "200 Type set to Binary");
 }
 
-void handle_pasv(ftp_session_t *session) {
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    
-    if (session->data_sock > 0) {
-        close(session->data_sock);
-    }
-    
-    session->data_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (session->data_sock < 0) {
-        send_response(session->control_sock, "425 Cannot open data connection");
-        return;
+// Data port pool: every port in the range gets one listening socket, created
+// once at startup and handed out through a lock-free free-list. A session owns
+// its slot until the next PASV/EPSV or disconnect, so ports never collide.
+typedef struct {
+    int fd;
+    int port;
+    uint32_t next;          // Free-list link: slot index + 1, 0 = end
+} data_port_t;
+
+static data_port_t data_ports[DATA_PORT_COUNT];
+static uint64_t data_port_free = 0;     // (ABA tag << 32) | (slot index + 1)
+
+static int data_port_open(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
     }
     
     int opt = 1;
-    setsockopt(session->data_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     
-    // Prevent SIGPIPE on write to closed socket (BSD/PS5 specific)
+    // Options set on the listener are inherited by every accepted data connection
     int no_sigpipe = 1;
-    setsockopt(session->data_sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
     
-    // 4MB buffers for maximum speed
     int sndbuf = BUFFER_SIZE;
     int rcvbuf = BUFFER_SIZE;
-    setsockopt(session->data_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
-    setsockopt(session->data_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
     
-    // Disable Nagle's algorithm for lower latency
     int nodelay = 1;
-    setsockopt(session->data_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     
+    struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(session->data_port);
+    addr.sin_port = htons(port);
     
-    if (bind(session->data_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        send_response(session->control_sock, "425 Cannot bind data port");
-        close(session->data_sock);
-        session->data_sock = -1;
-        return;
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void data_port_push(int slot) {
+    uint64_t head = __atomic_load_n(&data_port_free, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    do {
+        data_ports[slot].next = (uint32_t)head;
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)(slot + 1);
+    } while (!__atomic_compare_exchange_n(&data_port_free, &head, new_head, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static int data_port_pop(void) {
+    uint64_t head = __atomic_load_n(&data_port_free, __ATOMIC_ACQUIRE);
+    while ((uint32_t)head != 0) {
+        int slot = (int)(uint32_t)head - 1;
+        uint32_t next = __atomic_load_n(&data_ports[slot].next, __ATOMIC_ACQUIRE);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&data_port_free, &head, new_head, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Returns the number of ports that could be listened on
+int data_port_pool_init(void) {
+    int available = 0;
+    for (int i = DATA_PORT_COUNT - 1; i >= 0; i--) {
+        data_ports[i].port = DATA_PORT_START + i;
+        data_ports[i].fd = data_port_open(data_ports[i].port);
+        if (data_ports[i].fd >= 0) {
+            data_port_push(i);
+            available++;
+        }
+    }
+    return available;
+}
+
+// Drop connections left queued by a transfer that never accepted them
+static void data_port_drain(int slot) {
+    struct pollfd pfd = { data_ports[slot].fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        int stale = accept(data_ports[slot].fd, NULL, NULL);
+        if (stale < 0) break;
+        close(stale);
+    }
+}
+
+void data_port_release(ftp_session_t *session) {
+    if (session->data_slot >= 0) {
+        data_port_drain(session->data_slot);
+        data_port_push(session->data_slot);
+    }
+    session->data_slot = -1;
+    session->data_sock = -1;
+    session->data_port = 0;
+    session->passive_mode = 0;
+}
+
+int data_port_acquire(ftp_session_t *session) {
+    data_port_release(session);
+    
+    // Slots come back as soon as the holders accept, so under a burst of
+    // sessions it is worth waiting briefly instead of failing with 425
+    int slot = data_port_pop();
+    for (int waited = 0; slot < 0 && waited < DATA_PORT_WAIT_MS; waited += 5) {
+        usleep(5000);
+        slot = data_port_pop();
+    }
+    if (slot < 0) {
+        return -1;
     }
     
-    listen(session->data_sock, 1);
+    // A client may still connect late to a port its session gave up
+    data_port_drain(slot);
     
-    getsockname(session->data_sock, (struct sockaddr*)&addr, &addr_len);
+    session->data_slot = slot;
+    session->data_sock = data_ports[slot].fd;
+    session->data_port = data_ports[slot].port;
+    session->passive_mode = 1;
+    return 0;
+}
+
+// Accept the data connection, then hand the port straight back to the pool:
+// a PASV/EPSV covers exactly one transfer. Connections from any address other
+// than the control connection's peer are refused.
+int data_accept(ftp_session_t *session) {
+    struct sockaddr_in control_addr;
+    socklen_t control_len = sizeof(control_addr);
+    int check_peer = getpeername(session->control_sock, (struct sockaddr*)&control_addr, &control_len) == 0 &&
+                     control_addr.sin_family == AF_INET;
+    
+    int sock;
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        sock = accept(session->data_sock, (struct sockaddr*)&addr, &addr_len);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (!check_peer || addr.sin_addr.s_addr == control_addr.sin_addr.s_addr) {
+            break;
+        }
+        close(sock);
+    }
+    data_port_release(session);
+    return sock;
+}
+
+void handle_pasv(ftp_session_t *session) {
+    if (data_port_acquire(session) < 0) {
+        send_response(session->control_sock, "425 No free data port");
+        return;
+    }
     
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
     getsockname(session->control_sock, (struct sockaddr*)&addr, &addr_len);
     unsigned char *ip = (unsigned char*)&addr.sin_addr.s_addr;
     
@@ -168,7 +1881,26 @@ void handle_pasv(ftp_session_t *session) {
              session->data_port >> 8, session->data_port & 0xFF);
     
     send_response(session->control_sock, response);
-    session->passive_mode = 1;
+}
+
+void handle_epsv(ftp_session_t *session, const char *arg) {
+    if (strcasecmp(arg, "ALL") == 0) {
+        send_response(session->control_sock, "200 EPSV ALL accepted");
+        return;
+    }
+    if (arg[0] && strcmp(arg, "1") != 0) {
+        send_response(session->control_sock, "522 Network protocol not supported, use (1)");
+        return;
+    }
+    
+    if (data_port_acquire(session) < 0) {
+        send_response(session->control_sock, "425 No free data port");
+        return;
+    }
+    
+    char response[64];
+    snprintf(response, sizeof(response), "229 Entering Extended Passive Mode (|||%d|)", session->data_port);
+    send_response(session->control_sock, response);
 }
 
 void handle_list(ftp_session_t *session, const char *path) {
@@ -179,12 +1911,45 @@ void handle_list(ftp_session_t *session, const char *path) {
     
     send_response(session->control_sock, "150 Opening data connection");
     
-    int client_sock = accept(session->data_sock, NULL, NULL);
+    int client_sock = data_accept(session);
     if (client_sock < 0) {
         send_response(session->control_sock, "425 Cannot open data connection");
         return;
     }
     
+    listing_free(session);
+    strcpy(session->listing_dir, session->current_dir);
+    
+    struct stat dir_st;
+    int have_dir_st = stat(session->current_dir, &dir_st) == 0;
+    hot_blob_t *blob = have_dir_st ? hot_cache_get(HOT_LISTING, &dir_st) : NULL;
+    
+    if (blob) {
+        if (send_all(client_sock, blob->data, blob->len) == 0) {
+            session->transfer_bytes = blob->len;
+            __sync_fetch_and_add(&stats.cache_bytes_served, (uint64_t)blob->len);
+        }
+        const char *names_end = blob->data + blob->len + blob->names_len;
+        for (const char *name = blob->data + blob->len; name < names_end; name += strlen(name) + 1) {
+            listing_add(session, name);
+        }
+        hot_blob_release(blob);
+        close(client_sock);
+        send_response(session->control_sock, "226 Transfer complete");
+        return;
+    }
+    
+    // Build the whole reply in memory: one send instead of one per entry,
+    // and small directories can be cached as-is together with the names of
+    // their regular files for the prefetch list
+    char *out = NULL;
+    size_t out_len = 0;
+    size_t out_cap = 0;
+    char *names = NULL;
+    size_t names_len = 0;
+    size_t names_cap = 0;
+    int cacheable = have_dir_st;
+    
     DIR *dir = opendir(session->current_dir);
     if (dir) {
         struct dirent *entry;
@@ -215,20 +1980,141 @@ void handle_list(ftp_session_t *session, const char *path) {
                 // If all fails, assume it's a file with size 0
             }
             
-            snprintf(buffer, sizeof(buffer),
-                     "%crwxrwxrwx 1 root root %10ld Jan  1 00:00 %s\r\n",
-                     is_dir ? 'd' : '-',
-                     file_size,
-                     entry->d_name);
-            send(client_sock, buffer, strlen(buffer), 0);
+            if (!is_dir) {
+                listing_add(session, entry->d_name);
+                
+                size_t name_size = strlen(entry->d_name) + 1;
+                if (cacheable && names_len + name_size > names_cap) {
+                    size_t cap = names_cap ? names_cap * 2 : 16 * 1024;
+                    while (cap < names_len + name_size) cap *= 2;
+                    char *grown = realloc(names, cap);
+                    if (grown) {
+                        names = grown;
+                        names_cap = cap;
+                    } else {
+                        cacheable = 0;
+                    }
+                }
+                if (cacheable) {
+                    memcpy(names + names_len, entry->d_name, name_size);
+                    names_len += name_size;
+                }
+            }
+            
+            int line_len = snprintf(buffer, sizeof(buffer),
+                                    "%crwxrwxrwx 1 root root %10ld Jan  1 00:00 %s\r\n",
+                                    is_dir ? 'd' : '-',
+                                    file_size,
+                                    entry->d_name);
+            if (line_len < 0 || line_len >= (int)sizeof(buffer)) {
+                continue;
+            }
+            if (out_len + line_len > out_cap) {
+                size_t cap = out_cap ? out_cap * 2 : 64 * 1024;
+                char *grown = realloc(out, cap);
+                if (!grown) {
+                    cacheable = 0;
+                    break;
+                }
+                out = grown;
+                out_cap = cap;
+            }
+            memcpy(out + out_len, buffer, line_len);
+            out_len += line_len;
         }
         closedir(dir);
+        
+        if (cacheable) {
+            hot_cache_put(HOT_LISTING, &dir_st, out, out_len, names, names_len);
+        }
+    }
+    
+    if (out_len > 0 && send_all(client_sock, out, out_len) == 0) {
+        session->transfer_bytes = out_len;
     }
+    free(out);
+    free(names);
     
     close(client_sock);
     send_response(session->control_sock, "226 Transfer complete");
 }
 
+// Small files are answered from memory: the cached copy while it is still
+// current, otherwise a single read() that also fills the cache.
+// Returns 0 if the caller should fall back to the regular disk path.
+int retr_from_memory(ftp_session_t *session, const char *filename, const char *filepath, const struct stat *st) {
+    hot_blob_t *blob = hot_cache_get(HOT_FILE, st);
+    char *data = NULL;
+    size_t len;
+    
+    if (blob) {
+        data = blob->data;
+        len = blob->len;
+    } else {
+        int fd = open(filepath, O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        
+        struct stat fst;
+        off_t done = -1;
+        data = malloc(st->st_size > 0 ? st->st_size : 1);
+        if (data && fstat(fd, &fst) == 0 && fst.st_size == st->st_size) {
+            ssize_t n;
+            done = 0;
+            while (done < fst.st_size && (n = read(fd, data + done, fst.st_size - done)) > 0) {
+                done += n;
+            }
+        }
+        close(fd);
+        
+        if (done != st->st_size) {
+            free(data);
+            return 0;
+        }
+        len = done;
+        hot_cache_put(HOT_FILE, &fst, data, len, NULL, 0);
+    }
+    
+    size_t offset = session->restart_offset > 0 ? (size_t)session->restart_offset : 0;
+    session->restart_offset = 0;
+    if (offset > len) {
+        offset = len;
+    }
+    
+    prefetch_note_retr(filepath);
+    prefetch_next(session, filename);
+    
+    send_response(session->control_sock, "150 Opening data connection");
+    
+    int client_sock = data_accept(session);
+    if (client_sock < 0) {
+        send_error_response(session->control_sock, 425, "Cannot open data connection");
+    } else {
+        int ok = send_all(client_sock, data + offset, len - offset) == 0;
+        close(client_sock);
+        
+        if (ok) {
+            __sync_fetch_and_add(&stats.downloads, 1);
+            __sync_fetch_and_add(&stats.download_bytes, (uint64_t)(len - offset));
+            if (blob) {
+                __sync_fetch_and_add(&stats.cache_bytes_served, (uint64_t)(len - offset));
+            }
+            session->transfer_bytes = len - offset;
+            send_response(session->control_sock, "226 Transfer complete");
+        } else {
+            send_error_response(session->control_sock, 426, "Transfer aborted");
+        }
+    }
+    
+    if (blob) {
+        hot_blob_release(blob);
+    } else {
+        free(data);
+    }
+    return 1;
+}
+
 void handle_retr(ftp_session_t *session, const char *filename) {
     if (!session->passive_mode || session->data_sock < 0) {
         send_response(session->control_sock, "425 Use PASV first");
@@ -238,13 +2124,18 @@ void handle_retr(ftp_session_t *session, const char *filename) {
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "%s/%s", session->current_dir, filename);
     
+    struct stat st;
+    if (HOT_CACHE_SIZE > 0 && stat(filepath, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size <= HOT_CACHE_FILE_MAX && retr_from_memory(session, filename, filepath, &st)) {
+        return;
+    }
+    
     int fd = open(filepath, O_RDONLY);
     if (fd < 0) {
         send_error_response(session->control_sock, 550, "File not found");
         return;
     }
     
-    struct stat st;
     if (fstat(fd, &st) < 0) {
         send_error_response(session->control_sock, 550, "Cannot stat file");
         close(fd);
@@ -257,6 +2148,10 @@ void handle_retr(ftp_session_t *session, const char *filename) {
         session->restart_offset = 0;
     }
     
+    prefetch_note_retr(filepath);
+    readahead_apply(fd, offset, file_size);
+    prefetch_next(session, filename);
+    
     // Send start notification for files > 1MB
     if (file_size > 1*1024*1024) {
         char notif[128];
@@ -272,7 +2167,7 @@ void handle_retr(ftp_session_t *session, const char *filename) {
     
     send_response(session->control_sock, "150 Opening data connection");
     
-    int client_sock = accept(session->data_sock, NULL, NULL);
+    int client_sock = data_accept(session);
     if (client_sock < 0) {
         send_error_response(session->control_sock, 425, "Cannot open data connection");
         close(fd);
@@ -296,6 +2191,7 @@ void handle_retr(ftp_session_t *session, const char *filename) {
     // Try zero-copy sendfile first (much faster!)
     off_t bytes_to_send = file_size - offset;
     off_t sent_total = 0;
+    uint64_t transfer_start_us = now_us();
     
     #ifdef __FreeBSD__
     // PS5 uses FreeBSD - use sendfile for zero-copy transfer with progress tracking
@@ -307,7 +2203,12 @@ void handle_retr(ftp_session_t *session, const char *filename) {
         off_t chunk_size = bytes_to_send - sent_total;
         
         // Send in chunks for progress tracking
-        int sf_result = sendfile(fd, client_sock, current_offset, chunk_size, NULL, &sbytes, 0);
+        #ifdef SF_FLAGS
+        int sf_flags = SF_FLAGS(readahead_size() / 4096, 0);
+        #else
+        int sf_flags = 0;
+        #endif
+        int sf_result = sendfile(fd, client_sock, current_offset, chunk_size, NULL, &sbytes, sf_flags);
         
         if (sbytes > 0) {
             sent_total += sbytes;
@@ -365,6 +2266,10 @@ void handle_retr(ftp_session_t *session, const char *filename) {
         setsockopt(client_sock, IPPROTO_TCP, TCP_NOPUSH, &nopush, sizeof(nopush));
         close(fd);
         close(client_sock);
+        link_rate_update(sent_total, now_us() - transfer_start_us);
+        __sync_fetch_and_add(&stats.downloads, 1);
+        __sync_fetch_and_add(&stats.download_bytes, (uint64_t)sent_total);
+        session->transfer_bytes = sent_total;
         send_response(session->control_sock, "226 Transfer complete");
         return;
     }
@@ -415,6 +2320,10 @@ void handle_retr(ftp_session_t *session, const char *filename) {
     close(fd);
     close(client_sock);
     
+    link_rate_update(sent_total, now_us() - transfer_start_us);
+    __sync_fetch_and_add(&stats.downloads, 1);
+    __sync_fetch_and_add(&stats.download_bytes, (uint64_t)sent_total);
+    session->transfer_bytes = sent_total;
     send_response(session->control_sock, "226 Transfer complete");
 }
 
@@ -427,7 +2336,21 @@ void handle_stor(ftp_session_t *session, const char *filename) {
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "%s/%s", session->current_dir, filename);
     
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // A deduplicated file may share its inode with other paths: a fresh
+    // upload simply gets a new inode, a resumed one continues a private copy
+    struct stat st;
+    if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        if (session->restart_offset == 0) {
+            unlink(filepath);
+        } else if (break_hard_link(filepath) < 0) {
+            session->restart_offset = 0;
+            send_response(session->control_sock, "550 Cannot create file");
+            return;
+        }
+    }
+    
+    // A resumed upload keeps the data before the restart offset
+    int fd = open(filepath, O_WRONLY | O_CREAT | (session->restart_offset > 0 ? 0 : O_TRUNC), 0644);
     if (fd < 0) {
         send_response(session->control_sock, "550 Cannot create file");
         return;
@@ -435,7 +2358,7 @@ void handle_stor(ftp_session_t *session, const char *filename) {
     
     send_response(session->control_sock, "150 Opening data connection");
     
-    int client_sock = accept(session->data_sock, NULL, NULL);
+    int client_sock = data_accept(session);
     if (client_sock < 0) {
         send_response(session->control_sock, "425 Cannot open data connection");
         close(fd);
@@ -458,9 +2381,16 @@ void handle_stor(ftp_session_t *session, const char *filename) {
         return;
     }
     
+    // Only complete uploads can be indexed by content hash
+    int hashing = 1;
+    sha256_ctx_t sha;
+    sha256_init(&sha);
+    
     if (session->restart_offset > 0) {
+        ftruncate(fd, session->restart_offset);
         lseek(fd, session->restart_offset, SEEK_SET);
         session->restart_offset = 0;
+        hashing = 0;
     }
     
     // Track upload progress
@@ -481,6 +2411,12 @@ void handle_stor(ftp_session_t *session, const char *filename) {
         }
         total_received += written;
         
+        if (written < n) {
+            hashing = 0;
+        } else if (hashing) {
+            sha256_update(&sha, (const uint8_t*)buffer, n);
+        }
+        
         // Progress notification every 500MB for large uploads
         if (total_received - last_notif_bytes >= 500*1024*1024) {
             char notif[128];
@@ -504,10 +2440,19 @@ void handle_stor(ftp_session_t *session, const char *filename) {
         send_notification(notif);
     }
     
+    if (hashing && n == 0 && fstat(fd, &st) == 0) {
+        uint8_t hash[32];
+        sha256_final(&sha, hash);
+        hash_index_add(filepath, &st, hash);
+    }
+    
     free(buffer);
     close(fd);
     close(client_sock);
     
+    hot_cache_invalidate_path(filepath);
+    journal_record("STOR", filepath);
+    session->transfer_bytes = total_received;
     send_response(session->control_sock, "226 Transfer complete");
 }
 
@@ -521,14 +2466,18 @@ void handle_dele(ftp_session_t *session, const char *filename) {
         return;
     }
     
+    hot_cache_invalidate_path(filepath);
+    
     if (S_ISDIR(st.st_mode)) {
         if (rmdir(filepath) == 0) {
+            journal_record("RMD", filepath);
             send_response(session->control_sock, "250 Directory deleted");
         } else {
             send_response(session->control_sock, "550 Directory not empty or delete failed");
         }
     } else {
         if (unlink(filepath) == 0) {
+            journal_record("DELE", filepath);
             send_response(session->control_sock, "250 File deleted");
         } else {
             char error_msg[256];
@@ -538,6 +2487,516 @@ void handle_dele(ftp_session_t *session, const char *filename) {
     }
 }
 
+// Pick a block size near sqrt(file size), as rsync does, so the signature
+// stays small for huge files while small edits still produce small deltas
+static uint32_t delta_block_size(off_t file_size) {
+    uint32_t block_size = DELTA_MIN_BLOCK;
+    while (block_size < DELTA_MAX_BLOCK && (off_t)block_size * block_size < file_size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+void handle_site_dsig(ftp_session_t *session, const char *filename) {
+    if (!session->passive_mode || session->data_sock < 0) {
+        send_response(session->control_sock, "425 Use PASV first");
+        return;
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "%s/%s", session->current_dir, filename);
+    
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        send_error_response(session->control_sock, 550, "File not found");
+        return;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        send_response(session->control_sock, "550 Not a regular file");
+        close(fd);
+        return;
+    }
+    
+    uint32_t block_size = delta_block_size(st.st_size);
+    
+    char *buffer = malloc(BUFFER_SIZE);
+    delta_sig_block_t *sig = malloc((BUFFER_SIZE / DELTA_MIN_BLOCK) * sizeof(delta_sig_block_t));
+    if (!buffer || !sig) {
+        send_response(session->control_sock, "451 Memory allocation failed");
+        free(buffer);
+        free(sig);
+        close(fd);
+        return;
+    }
+    
+    send_response(session->control_sock, "150 Opening data connection for signature");
+    
+    int client_sock = data_accept(session);
+    if (client_sock < 0) {
+        send_response(session->control_sock, "425 Cannot open data connection");
+        free(buffer);
+        free(sig);
+        close(fd);
+        return;
+    }
+    
+    int no_sigpipe = 1;
+    setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+    
+    delta_sig_header_t hdr;
+    hdr.magic = DELTA_SIG_MAGIC;
+    hdr.block_size = block_size;
+    hdr.file_size = st.st_size;
+    hdr.mtime = st.st_mtime;
+    hdr.block_count = (uint32_t)((st.st_size + block_size - 1) / block_size);
+    
+    int ok = send_all(client_sock, &hdr, sizeof(hdr)) == 0;
+    uint64_t sent = sizeof(hdr);
+    
+    // Fill whole buffers (a multiple of block_size) so block boundaries stay
+    // aligned across short reads, then emit one entry per block
+    ssize_t bytes_read = 0;
+    int read_error = 0;
+    while (ok) {
+        bytes_read = 0;
+        while (bytes_read < BUFFER_SIZE) {
+            ssize_t n = read(fd, buffer + bytes_read, BUFFER_SIZE - bytes_read);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                read_error = 1;
+                break;
+            }
+            if (n == 0) break;
+            bytes_read += n;
+        }
+        if (read_error || bytes_read == 0) {
+            break;
+        }
+        
+        size_t count = 0;
+        for (ssize_t pos = 0; pos < bytes_read; pos += block_size) {
+            size_t len = (size_t)(bytes_read - pos) < block_size ? (size_t)(bytes_read - pos) : block_size;
+            const uint8_t *block = (const uint8_t*)buffer + pos;
+            
+            sha256_ctx_t ctx;
+            uint8_t hash[32];
+            sha256_init(&ctx);
+            sha256_update(&ctx, block, len);
+            sha256_final(&ctx, hash);
+            
+            sig[count].weak = delta_weak_checksum(block, len);
+            memcpy(sig[count].strong, hash, DELTA_STRONG_LEN);
+            count++;
+        }
+        ok = send_all(client_sock, sig, count * sizeof(delta_sig_block_t)) == 0;
+        sent += count * sizeof(delta_sig_block_t);
+        
+        if (bytes_read < BUFFER_SIZE) {
+            break;
+        }
+    }
+    
+    free(buffer);
+    free(sig);
+    close(fd);
+    close(client_sock);
+    
+    session->transfer_bytes = sent;
+    if (ok && !read_error) {
+        send_response(session->control_sock, "226 Signature sent");
+    } else {
+        send_error_response(session->control_sock, 426, "Signature transfer aborted");
+    }
+}
+
+// Files with a SITE DAPPLY in progress, by dev/inode of the basis
+typedef struct {
+    int used;
+    uint64_t dev;
+    uint64_t ino;
+} delta_apply_slot_t;
+
+static pthread_mutex_t delta_apply_lock = PTHREAD_MUTEX_INITIALIZER;
+static delta_apply_slot_t delta_applies[DELTA_APPLY_MAX];
+
+static delta_apply_slot_t *delta_apply_claim(const struct stat *st) {
+    delta_apply_slot_t *slot = NULL;
+    pthread_mutex_lock(&delta_apply_lock);
+    for (int i = 0; i < DELTA_APPLY_MAX; i++) {
+        if (delta_applies[i].used && delta_applies[i].dev == (uint64_t)st->st_dev &&
+            delta_applies[i].ino == (uint64_t)st->st_ino) {
+            slot = NULL;
+            break;
+        }
+        if (!delta_applies[i].used && !slot) {
+            slot = &delta_applies[i];
+        }
+    }
+    if (slot) {
+        slot->used = 1;
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+    }
+    pthread_mutex_unlock(&delta_apply_lock);
+    return slot;
+}
+
+static void delta_apply_release(delta_apply_slot_t *slot) {
+    pthread_mutex_lock(&delta_apply_lock);
+    slot->used = 0;
+    pthread_mutex_unlock(&delta_apply_lock);
+}
+
+void handle_site_dapply(ftp_session_t *session, const char *filename) {
+    if (!session->passive_mode || session->data_sock < 0) {
+        send_response(session->control_sock, "425 Use PASV first");
+        return;
+    }
+    
+    char filepath[MAX_PATH];
+    char temppath[MAX_PATH + 32];
+    snprintf(filepath, MAX_PATH, "%s/%s", session->current_dir, filename);
+    
+    int basis_fd = open(filepath, O_RDONLY);
+    if (basis_fd < 0) {
+        send_error_response(session->control_sock, 550, "File not found");
+        return;
+    }
+    
+    struct stat st;
+    if (fstat(basis_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        send_response(session->control_sock, "550 Not a regular file");
+        close(basis_fd);
+        return;
+    }
+    
+    // One apply per file: a second one would rename over the first's result
+    delta_apply_slot_t *apply = delta_apply_claim(&st);
+    if (!apply) {
+        send_response(session->control_sock, "450 Another delta apply is in progress for this file");
+        close(basis_fd);
+        return;
+    }
+    
+    int out_fd = create_temp_file(filepath, "delta", st.st_mode & 0777, temppath, sizeof(temppath));
+    if (out_fd < 0) {
+        send_error_response(session->control_sock, 550, "Cannot create temporary file");
+        delta_apply_release(apply);
+        close(basis_fd);
+        return;
+    }
+    fchmod(out_fd, st.st_mode & 0777);
+    
+    char *buffer = malloc(BUFFER_SIZE);
+    if (!buffer) {
+        send_response(session->control_sock, "451 Memory allocation failed");
+        close(out_fd);
+        unlink(temppath);
+        delta_apply_release(apply);
+        close(basis_fd);
+        return;
+    }
+    
+    send_response(session->control_sock, "150 Opening data connection for delta");
+    
+    int client_sock = data_accept(session);
+    if (client_sock < 0) {
+        send_response(session->control_sock, "425 Cannot open data connection");
+        free(buffer);
+        close(out_fd);
+        unlink(temppath);
+        delta_apply_release(apply);
+        close(basis_fd);
+        return;
+    }
+    
+    int rcvbuf = BUFFER_SIZE;
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    
+    const char *error = NULL;
+    uint64_t received = 0;
+    uint64_t written = 0;
+    uint8_t actual[32];
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    
+    delta_apply_header_t hdr;
+    if (recv_all(client_sock, &hdr, sizeof(hdr)) < 0 || hdr.magic != DELTA_APPLY_MAGIC) {
+        error = "501 Invalid delta stream";
+    } else if (hdr.block_size != delta_block_size(st.st_size) ||
+               hdr.basis_size != (uint64_t)st.st_size || hdr.basis_mtime != (int64_t)st.st_mtime) {
+        // File changed since SITE DSIG - the block references are stale
+        error = "450 File changed since signature, request a new one";
+    }
+    received += sizeof(hdr);
+    
+    while (!error) {
+        delta_op_t op;
+        if (recv_all(client_sock, &op, sizeof(op)) < 0) {
+            error = "426 Delta stream truncated";
+            break;
+        }
+        received += sizeof(op);
+        
+        if (op.op == DELTA_OP_END) {
+            uint8_t expected[32];
+            if (recv_all(client_sock, expected, sizeof(expected)) < 0) {
+                error = "426 Delta stream truncated";
+                break;
+            }
+            received += sizeof(expected);
+            sha256_final(&ctx, actual);
+            if (memcmp(expected, actual, sizeof(actual)) != 0) {
+                error = "550 Delta checksum mismatch";
+            }
+            break;
+        } else if (op.op == DELTA_OP_LITERAL) {
+            if (op.arg1 > DELTA_MAX_LITERAL || op.arg1 > BUFFER_SIZE) {
+                error = "501 Literal too large";
+                break;
+            }
+            if (recv_all(client_sock, buffer, op.arg1) < 0) {
+                error = "426 Delta stream truncated";
+                break;
+            }
+            received += op.arg1;
+            if (write_all(out_fd, buffer, op.arg1) < 0) {
+                error = "452 Write failed";
+                break;
+            }
+            sha256_update(&ctx, (const uint8_t*)buffer, op.arg1);
+            written += op.arg1;
+        } else if (op.op == DELTA_OP_COPY) {
+            off_t start = (off_t)op.arg1 * hdr.block_size;
+            off_t end = start + (off_t)op.arg2 * hdr.block_size;
+            if (end > st.st_size) end = st.st_size;
+            if (op.arg2 == 0 || start >= st.st_size) {
+                error = "501 Block reference out of range";
+                break;
+            }
+            while (start < end) {
+                size_t chunk = end - start < BUFFER_SIZE ? (size_t)(end - start) : BUFFER_SIZE;
+                ssize_t n = pread(basis_fd, buffer, chunk, start);
+                if (n <= 0) {
+                    error = "451 Read failed";
+                    break;
+                }
+                if (write_all(out_fd, buffer, n) < 0) {
+                    error = "452 Write failed";
+                    break;
+                }
+                sha256_update(&ctx, (const uint8_t*)buffer, n);
+                written += n;
+                start += n;
+            }
+        } else {
+            error = "501 Unknown delta operation";
+        }
+    }
+    
+    free(buffer);
+    close(client_sock);
+    close(basis_fd);
+    
+    if (!error && close(out_fd) < 0) {
+        error = "452 Write failed";
+    } else if (error) {
+        close(out_fd);
+    }
+    
+    // Atomic replace: readers see either the old or the complete new file
+    if (!error && rename(temppath, filepath) < 0) {
+        error = "550 Rename failed";
+    }
+    delta_apply_release(apply);
+    session->transfer_bytes = received;
+    if (error) {
+        unlink(temppath);
+        send_response(session->control_sock, error);
+        return;
+    }
+    
+    hot_cache_invalidate_path(filepath);
+    journal_record("STOR", filepath);
+    if (stat(filepath, &st) == 0) {
+        hash_index_add(filepath, &st, actual);
+    }
+    
+    char response[128];
+    snprintf(response, sizeof(response), "226 Delta applied (%llu bytes received, %llu bytes written)",
+             (unsigned long long)received, (unsigned long long)written);
+    send_response(session->control_sock, response);
+}
+
+static int parse_sha256_hex(const char *hex, uint8_t out[32]) {
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (!hex[i * 2] || !hex[i * 2 + 1] || sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return hex[64] == '\0' ? 0 : -1;
+}
+
+// SITE DEDUP <size> <sha256-hex> <file>: create <file> from an identical
+// file already on the console instead of uploading it again
+void handle_site_dedup(ftp_session_t *session, const char *arg) {
+    long long size;
+    char hex[65] = {0};
+    char filename[MAX_PATH] = {0};
+    uint8_t sha256[32];
+    
+    if (sscanf(arg, "%lld %64s %1023[^\r\n]", &size, hex, filename) != 3 ||
+        size < 0 || parse_sha256_hex(hex, sha256) < 0) {
+        send_response(session->control_sock, "501 Syntax: SITE DEDUP <size> <sha256> <file>");
+        return;
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "%s/%s", session->current_dir, filename);
+    
+    char source[MAX_PATH];
+    if (!hash_index_find((uint64_t)size, sha256, source, sizeof(source)) &&
+        !hash_index_scan((uint64_t)size, sha256, source, sizeof(source))) {
+        send_response(session->control_sock, "550 No identical file on server, use STOR");
+        return;
+    }
+    
+    struct stat src_st, dst_st;
+    if (stat(source, &src_st) < 0) {
+        send_response(session->control_sock, "550 No identical file on server, use STOR");
+        return;
+    }
+    if (stat(filepath, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        send_response(session->control_sock, "250 File already present");
+        return;
+    }
+    
+    // Hard link when possible (same filesystem), otherwise copy locally.
+    // Either way the result is renamed over the target in one step.
+    char temppath[MAX_PATH + 32];
+    int linked = -1;
+    for (int attempt = 0; attempt < 16 && linked < 0; attempt++) {
+        temp_path_name(filepath, "dedup", temppath, sizeof(temppath));
+        linked = link(source, temppath);
+        if (linked < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    
+    const char *how = "linked";
+    if (linked < 0 || rename(temppath, filepath) < 0) {
+        if (linked == 0) {
+            unlink(temppath);
+        }
+        how = "copied";
+        if (copy_file(source, filepath, src_st.st_mode & 0777) < 0) {
+            send_error_response(session->control_sock, 550, "Deduplication failed, use STOR");
+            return;
+        }
+    }
+    
+    hot_cache_invalidate_path(filepath);
+    journal_record("STOR", filepath);
+    
+    // Index the new path too, so the content stays findable if the source goes away.
+    // link() changed the shared inode's ctime, so the source entry is refreshed as well.
+    if (stat(filepath, &dst_st) == 0) {
+        hash_index_add(filepath, &dst_st, sha256);
+        if (dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+            hash_index_add(source, &dst_st, sha256);
+        }
+    }
+    
+    char response[64];
+    snprintf(response, sizeof(response), "250 File %s from existing copy", how);
+    send_response(session->control_sock, response);
+}
+
+// SITE CHANGES <token>: stream "<seq> <op> <path>" lines for everything
+// changed after the token; without a token, just report the current one
+void handle_site_changes(ftp_session_t *session, const char *token) {
+    char current[64];
+    char response[128];
+    
+    if (token[0] == '\0') {
+        journal_token(current, sizeof(current));
+        snprintf(response, sizeof(response), "200 %s", current);
+        send_response(session->control_sock, response);
+        return;
+    }
+    
+    long long epoch;
+    uint64_t since;
+    if (journal_parse_token(token, &epoch, &since) < 0) {
+        send_response(session->control_sock, "501 Syntax: SITE CHANGES [<epoch>:<seq>]");
+        return;
+    }
+    
+    if (!session->passive_mode || session->data_sock < 0) {
+        send_response(session->control_sock, "425 Use PASV first");
+        return;
+    }
+    
+    char *changes;
+    size_t len;
+    uint64_t last_seq;
+    if (journal_changes_since(epoch, since, &changes, &len, &last_seq) < 0) {
+        send_response(session->control_sock, "450 Change token expired, full rescan required");
+        return;
+    }
+    
+    send_response(session->control_sock, "150 Opening data connection for changes");
+    
+    int client_sock = data_accept(session);
+    if (client_sock < 0) {
+        send_response(session->control_sock, "425 Cannot open data connection");
+        free(changes);
+        return;
+    }
+    
+    int ok = len == 0 || send_all(client_sock, changes, len) == 0;
+    close(client_sock);
+    free(changes);
+    
+    session->transfer_bytes = len;
+    if (ok) {
+        // Hand back the token matching exactly what was sent
+        journal_token(current, sizeof(current));
+        *strchr(current, ':') = '\0';
+        snprintf(response, sizeof(response), "226 Changes complete, token %s:%llu",
+                 current, (unsigned long long)last_seq);
+        send_response(session->control_sock, response);
+    } else {
+        send_response(session->control_sock, "426 Transfer aborted");
+    }
+}
+
+void handle_site_watch(ftp_session_t *session, const char *dirname) {
+    char dirpath[MAX_PATH];
+    if (dirname[0] == '/') {
+        snprintf(dirpath, MAX_PATH, "%s", dirname);
+    } else {
+        snprintf(dirpath, MAX_PATH, "%s/%s", session->current_dir, dirname[0] ? dirname : ".");
+    }
+    
+    #ifdef __FreeBSD__
+    struct stat st;
+    if (stat(dirpath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        send_response(session->control_sock, "550 Directory not found");
+    } else if (watch_add(dirpath) == 0) {
+        send_response(session->control_sock, "200 Directory watched for changes");
+    } else {
+        send_error_response(session->control_sock, 550, "Cannot watch directory");
+    }
+    #else
+    send_response(session->control_sock, "502 Filesystem watches not supported on this platform");
+    #endif
+}
+
 void* client_thread(void* arg) {
     client_info_t* client_info = (client_info_t*)arg;
     int client_sock = client_info->client_sock;
@@ -545,25 +3004,32 @@ void* client_thread(void* arg) {
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &client_info->client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
     
-    free(client_info);
-    
     ftp_session_t session;
     memset(&session, 0, sizeof(session));
     
     session.control_sock = client_sock;
     session.data_sock = -1;
-    session.data_port = DATA_PORT_START + (client_sock % 100);
+    session.data_slot = -1;
     strcpy(session.current_dir, "/");
     session.passive_mode = 0;
     session.restart_offset = 0;
+    session.last_retr_index = -1;
+    
+    trace_open(&session, &client_info->client_addr);
+    free(client_info);
     
     send_response(client_sock, "220 PS5 Fast FTP Server Ready");
     
     char buffer[1024];
-    while (1) {
+    int quit = 0;
+    while (!quit) {
         ssize_t n = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
         if (n <= 0) break;
         
+        uint64_t cmd_start_us = now_us();
+        session.transfer_bytes = 0;
+        last_reply_code = 0;
+        
         buffer[n] = '\0';
         
         char *end = strchr(buffer, '\r');
@@ -581,6 +3047,8 @@ void* client_thread(void* arg) {
             }
         }
         
+        // Transfer commands release their PASV/EPSV port after the handler
+        // returns, so a slot is not held when they fail before accepting
         if (strcmp(cmd, "USER") == 0) {
             handle_user(&session, arg);
         } else if (strcmp(cmd, "PASS") == 0) {
@@ -595,12 +3063,17 @@ void* client_thread(void* arg) {
             handle_type(&session, arg);
         } else if (strcmp(cmd, "PASV") == 0) {
             handle_pasv(&session);
+        } else if (strcmp(cmd, "EPSV") == 0) {
+            handle_epsv(&session, arg);
         } else if (strcmp(cmd, "LIST") == 0) {
             handle_list(&session, arg);
+            data_port_release(&session);
         } else if (strcmp(cmd, "RETR") == 0) {
             handle_retr(&session, arg);
+            data_port_release(&session);
         } else if (strcmp(cmd, "STOR") == 0) {
             handle_stor(&session, arg);
+            data_port_release(&session);
         } else if (strcmp(cmd, "DELE") == 0) {
             handle_dele(&session, arg);
         } else if (strcmp(cmd, "REST") == 0) {
@@ -611,7 +3084,9 @@ void* client_thread(void* arg) {
         } else if (strcmp(cmd, "RMD") == 0 || strcmp(cmd, "XRMD") == 0) {
             char filepath[MAX_PATH];
             snprintf(filepath, MAX_PATH, "%s/%s", session.current_dir, arg);
+            hot_cache_invalidate_path(filepath);
             if (rmdir(filepath) == 0) {
+                journal_record("RMD", filepath);
                 send_response(client_sock, "250 Directory removed");
             } else {
                 send_response(client_sock, "550 Remove directory failed");
@@ -620,6 +3095,8 @@ void* client_thread(void* arg) {
             char filepath[MAX_PATH];
             snprintf(filepath, MAX_PATH, "%s/%s", session.current_dir, arg);
             if (mkdir(filepath, 0755) == 0) {
+                hot_cache_invalidate_path(filepath);
+                journal_record("MKD", filepath);
                 char response[MAX_PATH + 32];
                 snprintf(response, sizeof(response), "257 \"%s\" created", filepath);
                 send_response(client_sock, response);
@@ -628,7 +3105,7 @@ void* client_thread(void* arg) {
             }
         } else if (strcmp(cmd, "QUIT") == 0) {
             send_response(client_sock, "221 Goodbye");
-            break;
+            quit = 1;
         } else if (strcmp(cmd, "SITE") == 0) {
             char subcmd[16] = {0};
             char subarg[MAX_PATH] = {0};
@@ -646,7 +3123,8 @@ void* client_thread(void* arg) {
                 if (sscanf(subarg, "%o %1023[^\r\n]", &mode, filepath) == 2) {
                     char fullpath[MAX_PATH];
                     snprintf(fullpath, MAX_PATH, "%s/%s", session.current_dir, filepath);
-                    if (chmod(fullpath, mode) == 0) {
+                    if (break_hard_link(fullpath) == 0 && chmod(fullpath, mode) == 0) {
+                        journal_record("CHMOD", fullpath);
                         send_response(client_sock, "200 CHMOD successful");
                     } else {
                         send_response(client_sock, "550 CHMOD failed");
@@ -654,6 +3132,34 @@ void* client_thread(void* arg) {
                 } else {
                     send_response(client_sock, "501 Invalid CHMOD syntax");
                 }
+            } else if (strcmp(subcmd, "DSIG") == 0) {
+                handle_site_dsig(&session, subarg);
+                data_port_release(&session);
+            } else if (strcmp(subcmd, "DAPPLY") == 0) {
+                handle_site_dapply(&session, subarg);
+                data_port_release(&session);
+            } else if (strcmp(subcmd, "DEDUP") == 0) {
+                handle_site_dedup(&session, subarg);
+            } else if (strcmp(subcmd, "CHANGES") == 0) {
+                handle_site_changes(&session, subarg);
+                if (subarg[0]) data_port_release(&session);
+            } else if (strcmp(subcmd, "WATCH") == 0) {
+                handle_site_watch(&session, subarg);
+            } else if (strcmp(subcmd, "STATS") == 0) {
+                handle_site_stats(&session);
+            } else if (strcmp(subcmd, "TRACE") == 0) {
+                for (int i = 0; subarg[i]; i++) {
+                    if (subarg[i] >= 'a' && subarg[i] <= 'z') subarg[i] -= 32;
+                }
+                if (strcmp(subarg, "ON") == 0) {
+                    trace_enabled = 1;
+                    send_response(client_sock, "200 Trace recording enabled for new sessions");
+                } else if (strcmp(subarg, "OFF") == 0) {
+                    trace_enabled = 0;
+                    send_response(client_sock, "200 Trace recording disabled for new sessions");
+                } else {
+                    send_response(client_sock, trace_enabled ? "200 Trace recording is ON" : "200 Trace recording is OFF");
+                }
             } else {
                 send_response(client_sock, "502 SITE command not implemented");
             }
@@ -688,6 +3194,7 @@ void* client_thread(void* arg) {
             send_response(client_sock, " MDTM");
             send_response(client_sock, " REST STREAM");
             send_response(client_sock, " PASV");
+            send_response(client_sock, " EPSV");
             send_response(client_sock, " UTF8");
             send_response(client_sock, "211 End");
         } else if (strcmp(cmd, "OPTS") == 0) {
@@ -706,11 +3213,14 @@ void* client_thread(void* arg) {
         } else {
             send_response(client_sock, "502 Command not implemented");
         }
+        
+        trace_command(&session, cmd, buffer, cmd_start_us);
     }
     
-    if (session.data_sock > 0) {
-        close(session.data_sock);
-    }
+    trace_close(&session);
+    listing_free(&session);
+    
+    data_port_release(&session);
     close(client_sock);
     
     return NULL;
@@ -747,7 +3257,12 @@ int main() {
         return 1;
     }
     
-    if (listen(server_sock, 5) < 0) {
+    if (listen(server_sock, SOMAXCONN) < 0) {
+        close(server_sock);
+        return 1;
+    }
+    
+    if (data_port_pool_init() == 0) {
         close(server_sock);
         return 1;
     }
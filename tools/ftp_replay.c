@@ -0,0 +1,440 @@
+/* PS5 FTP Server - Trace replay load tester
+ * Replays recorded control sessions (see trace.h) against a server,
+ * many sessions concurrently, at real or scaled speed.
+ *
+ * Usage: ftp_replay [-h host] [-p port] [-x speed] [-c copies] trace.trc...
+ *   -x speed   Time scale (2 = twice as fast, 0 = no think time)
+ *   -c copies  Number of concurrent sessions started per trace file
+ *
+ * Host-side tool, build with: make replay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "../trace.h"
+
+#define MAX_VERBS 48
+#define IO_BUFFER_SIZE (256 * 1024)
+#define IO_TIMEOUT_SEC 30
+
+typedef struct {
+    char verb[16];
+    uint64_t *latencies;
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+} verb_stats_t;
+
+typedef struct {
+    const char *trace_path;
+    int copy;
+
+    // Per-session results, merged after join
+    verb_stats_t verbs[MAX_VERBS];
+    int verb_count;
+    uint64_t commands;
+    uint64_t code_mismatches;
+    uint64_t data_bytes;
+    int failed;
+} replay_job_t;
+
+static const char *server_host = "127.0.0.1";
+static int server_port = 2121;
+static double speed = 1.0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_to(const char *host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // A stuck server session must show up as a failure, not hang the run
+    struct timeval tv = { IO_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Read one complete (possibly multi-line) reply, return its code or -1.
+// Fills text with the final line for PASV parsing.
+static int read_reply(int sock, char *text, size_t text_size) {
+    char line[1024];
+    size_t len = 0;
+    int multiline_code = 0;
+
+    while (1) {
+        char c;
+        ssize_t n = recv(sock, &c, 1, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (c != '\n') {
+            if (c != '\r' && len < sizeof(line) - 1) {
+                line[len++] = c;
+            }
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+
+        if (strlen(line) < 4 || line[0] < '0' || line[0] > '9') {
+            continue;
+        }
+        int code = atoi(line);
+        if (line[3] == '-') {
+            if (!multiline_code) multiline_code = code;
+            continue;
+        }
+        if (multiline_code && code != multiline_code) {
+            continue;
+        }
+        if (text) {
+            snprintf(text, text_size, "%s", line);
+        }
+        return code;
+    }
+}
+
+static int parse_pasv_port(const char *reply) {
+    const char *p = strchr(reply, '(');
+    int h1, h2, h3, h4, p1, p2;
+    if (!p || sscanf(p, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
+        return -1;
+    }
+    return (p1 << 8) | p2;
+}
+
+static int parse_epsv_port(const char *reply) {
+    const char *p = strstr(reply, "(|||");
+    if (!p) {
+        return -1;
+    }
+    return atoi(p + 4);
+}
+
+static verb_stats_t *verb_slot(replay_job_t *job, const char *verb) {
+    for (int i = 0; i < job->verb_count; i++) {
+        if (strcmp(job->verbs[i].verb, verb) == 0) {
+            return &job->verbs[i];
+        }
+    }
+    if (job->verb_count >= MAX_VERBS) {
+        return NULL;
+    }
+    verb_stats_t *v = &job->verbs[job->verb_count++];
+    memset(v, 0, sizeof(*v));
+    strncpy(v->verb, verb, sizeof(v->verb) - 1);
+    return v;
+}
+
+static void verb_add(verb_stats_t *v, uint64_t latency_us, uint64_t bytes) {
+    if (!v) {
+        return;
+    }
+    if (v->count == v->capacity) {
+        size_t cap = v->capacity ? v->capacity * 2 : 64;
+        uint64_t *p = realloc(v->latencies, cap * sizeof(uint64_t));
+        if (!p) {
+            return;
+        }
+        v->latencies = p;
+        v->capacity = cap;
+    }
+    v->latencies[v->count++] = latency_us;
+    v->bytes += bytes;
+}
+
+// Drain a download data connection, returning bytes received
+static uint64_t drain_data(int sock, char *buffer) {
+    uint64_t total = 0;
+    ssize_t n;
+    while ((n = recv(sock, buffer, IO_BUFFER_SIZE, 0)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+// Push the recorded number of bytes for an upload
+static uint64_t fill_data(int sock, char *buffer, uint64_t bytes) {
+    uint64_t total = 0;
+    while (total < bytes) {
+        size_t chunk = bytes - total < IO_BUFFER_SIZE ? (size_t)(bytes - total) : IO_BUFFER_SIZE;
+        ssize_t n = send(sock, buffer, chunk, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static void *replay_thread(void *arg) {
+    replay_job_t *job = (replay_job_t*)arg;
+
+    FILE *f = fopen(job->trace_path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", job->trace_path, strerror(errno));
+        job->failed = 1;
+        return NULL;
+    }
+
+    trace_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", job->trace_path);
+        fclose(f);
+        job->failed = 1;
+        return NULL;
+    }
+
+    int sock = connect_to(server_host, server_port);
+    char *buffer = malloc(IO_BUFFER_SIZE);
+    if (sock < 0 || !buffer || read_reply(sock, NULL, 0) != 220) {
+        fprintf(stderr, "%s#%d: cannot connect to %s:%d\n", job->trace_path, job->copy, server_host, server_port);
+        if (sock >= 0) close(sock);
+        free(buffer);
+        fclose(f);
+        job->failed = 1;
+        return NULL;
+    }
+    memset(buffer, 0xA5, IO_BUFFER_SIZE);
+
+    uint64_t start_us = now_us();
+    int data_port = -1;
+    int data_sock = -1;
+    trace_record_t rec;
+    char line[TRACE_MAX_LINE + 3];
+    char reply[1024];
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.line_len > TRACE_MAX_LINE || fread(line, 1, rec.line_len, f) != rec.line_len) {
+            break;
+        }
+        line[rec.line_len] = '\0';
+
+        char verb[16] = {0};
+        sscanf(line, "%15s", verb);
+        for (int i = 0; verb[i]; i++) {
+            if (verb[i] >= 'a' && verb[i] <= 'z') verb[i] -= 32;
+        }
+
+        // Honour the recorded think time, scaled
+        if (speed > 0) {
+            uint64_t due = start_us + (uint64_t)(rec.t_us / speed);
+            uint64_t now = now_us();
+            if (due > now) {
+                usleep(due - now);
+            }
+        }
+
+        // SITE extensions are reported per subcommand ("SITE DSIG", ...)
+        char subverb[16] = {0};
+        if (strcmp(verb, "SITE") == 0 && sscanf(line, "%*s %15s", subverb) == 1) {
+            for (int i = 0; subverb[i]; i++) {
+                if (subverb[i] >= 'a' && subverb[i] <= 'z') subverb[i] -= 32;
+            }
+            char label[16];
+            snprintf(label, sizeof(label), "SITE %.10s", subverb);
+            memcpy(verb, label, sizeof(verb));
+        }
+
+        // Open the passive connection the way a real client does, right after PASV/EPSV
+        int is_upload = strcmp(verb, "STOR") == 0 || strcmp(verb, "APPE") == 0 ||
+                        strcmp(verb, "SITE DAPPLY") == 0;
+        int is_transfer = is_upload || strcmp(verb, "LIST") == 0 || strcmp(verb, "NLST") == 0 ||
+                          strcmp(verb, "MLSD") == 0 || strcmp(verb, "RETR") == 0 ||
+                          strcmp(verb, "SITE DSIG") == 0 || strcmp(verb, "SITE CHANGES") == 0;
+        if (is_transfer && data_sock < 0 && data_port > 0) {
+            data_sock = connect_to(server_host, data_port);
+        }
+
+        uint64_t t0 = now_us();
+        size_t len = rec.line_len;
+        memcpy(line + len, "\r\n", 3);
+        if (send(sock, line, len + 2, MSG_NOSIGNAL) < 0) {
+            break;
+        }
+        line[len] = '\0';
+
+        int code = read_reply(sock, reply, sizeof(reply));
+        uint64_t moved = 0;
+        if (code == 150 || code == 125) {
+            if (data_sock >= 0) {
+                if (is_upload) {
+                    moved = fill_data(data_sock, buffer, rec.data_bytes);
+                } else {
+                    moved = drain_data(data_sock, buffer);
+                }
+                close(data_sock);
+                data_sock = -1;
+            }
+            code = read_reply(sock, reply, sizeof(reply));
+        }
+        if (is_transfer && data_sock >= 0) {
+            close(data_sock);
+            data_sock = -1;
+        }
+        if (code < 0) {
+            fprintf(stderr, "%s#%d: no reply to %s\n", job->trace_path, job->copy, verb);
+            job->failed = 1;
+            break;
+        }
+        uint64_t latency = now_us() - t0;
+
+        if (code == 227) {
+            data_port = parse_pasv_port(reply);
+        } else if (code == 229) {
+            data_port = parse_epsv_port(reply);
+        }
+        if (is_transfer) {
+            data_port = -1;
+        }
+
+        job->commands++;
+        job->data_bytes += moved;
+        if (rec.reply_code && code != rec.reply_code) {
+            job->code_mismatches++;
+        }
+        verb_add(verb_slot(job, verb[0] ? verb : "?"), latency, moved);
+
+        if (strcmp(verb, "QUIT") == 0) {
+            break;
+        }
+    }
+
+    if (data_sock >= 0) close(data_sock);
+    close(sock);
+    free(buffer);
+    fclose(f);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-x speed] [-c copies] trace.trc...\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int copies = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:x:c:")) != -1) {
+        switch (opt) {
+            case 'h': server_host = optarg; break;
+            case 'p': server_port = atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'c': copies = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || copies < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int traces = argc - optind;
+    int job_count = traces * copies;
+    replay_job_t *jobs = calloc(job_count, sizeof(replay_job_t));
+    pthread_t *threads = calloc(job_count, sizeof(pthread_t));
+    if (!jobs || !threads) {
+        return 1;
+    }
+
+    uint64_t start_us = now_us();
+    for (int i = 0; i < job_count; i++) {
+        jobs[i].trace_path = argv[optind + i % traces];
+        jobs[i].copy = i / traces;
+        if (pthread_create(&threads[i], NULL, replay_thread, &jobs[i]) != 0) {
+            jobs[i].failed = 1;
+            threads[i] = 0;
+        }
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_us() - start_us) / 1e6;
+
+    // Merge per-session results by verb
+    replay_job_t total;
+    memset(&total, 0, sizeof(total));
+    int failed = 0;
+    for (int i = 0; i < job_count; i++) {
+        replay_job_t *job = &jobs[i];
+        failed += job->failed;
+        total.commands += job->commands;
+        total.code_mismatches += job->code_mismatches;
+        total.data_bytes += job->data_bytes;
+        for (int v = 0; v < job->verb_count; v++) {
+            verb_stats_t *src = &job->verbs[v];
+            verb_stats_t *dst = verb_slot(&total, src->verb);
+            for (size_t k = 0; k < src->count; k++) {
+                verb_add(dst, src->latencies[k], 0);
+            }
+            if (dst) dst->bytes += src->bytes;
+            free(src->latencies);
+        }
+    }
+
+    printf("Sessions: %d (%d failed)  Commands: %llu  Reply mismatches: %llu\n",
+           job_count, failed, (unsigned long long)total.commands,
+           (unsigned long long)total.code_mismatches);
+    printf("Elapsed: %.2f s  Data: %.1f MB  Throughput: %.2f MB/s\n",
+           elapsed, total.data_bytes / (1024.0 * 1024.0),
+           elapsed > 0 ? total.data_bytes / (1024.0 * 1024.0) / elapsed : 0.0);
+    printf("\n%-12s %8s %10s %10s %10s %10s %12s\n",
+           "VERB", "COUNT", "MEAN ms", "P50 ms", "P95 ms", "MAX ms", "MB");
+
+    for (int v = 0; v < total.verb_count; v++) {
+        verb_stats_t *s = &total.verbs[v];
+        if (s->count == 0) continue;
+        qsort(s->latencies, s->count, sizeof(uint64_t), compare_u64);
+        uint64_t sum = 0;
+        for (size_t k = 0; k < s->count; k++) sum += s->latencies[k];
+        printf("%-12s %8zu %10.2f %10.2f %10.2f %10.2f %12.1f\n",
+               s->verb, s->count,
+               sum / 1000.0 / s->count,
+               s->latencies[s->count / 2] / 1000.0,
+               s->latencies[(s->count * 95) / 100] / 1000.0,
+               s->latencies[s->count - 1] / 1000.0,
+               s->bytes / (1024.0 * 1024.0));
+        free(s->latencies);
+    }
+
+    free(jobs);
+    free(threads);
+    return failed ? 1 : 0;
+}
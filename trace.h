@@ -0,0 +1,34 @@
+/* PS5 FTP Server - Control session trace format
+ * Shared by the server recorder (main.c) and the replay tool (tools/ftp_replay.c)
+ *
+ * File layout: trace_header_t, then one trace_record_t per command
+ * followed by line_len bytes of the raw command line (no CRLF).
+ * All fields are little-endian (native on PS5 and x86 hosts).
+ */
+
+#ifndef PS5_FTP_TRACE_H
+#define PS5_FTP_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x54355350u   // "PS5T"
+#define TRACE_VERSION 2
+#define TRACE_MAX_LINE 1024
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t start_time;    // Session start, seconds since epoch
+    uint32_t client_ip;     // Network byte order
+} trace_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t t_us;          // Command receipt, microseconds since session start
+    uint64_t latency_us;    // Receipt until the final reply was sent
+    uint64_t data_bytes;    // Bytes moved over the data connection
+    uint16_t reply_code;    // Last reply code sent for this command
+    uint16_t line_len;      // Length of the command line that follows
+} trace_record_t;
+
+#endif